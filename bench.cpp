@@ -0,0 +1,507 @@
+/*
+ * iio-bench - latency and throughput benchmarks for IIOC++
+ *
+ * Runs against real hardware or against iiod-sim on localhost:
+ *
+ *     iiod-sim -l 200 &
+ *     iio-bench ip:127.0.0.1 context
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "iioc++.h"
+#include "iioc++_async.h"
+#include "iioc++_burst.h"
+#include "iioc++_record.h"
+#include "iioc++_stream.h"
+#include "iioc++_supervisor.h"
+#include "iioc++_sweep.h"
+
+static void usage(const char *argv0)
+{
+    printf("Usage: %s <uri>[,<uri>...] <test> [options]\n"
+           "tests:\n"
+           "  context [cache_dir]   context creation from the network vs cached XML (offline, no I/O)\n"
+           "  attrs [n]             long filter_fir_config reads, each followed by an LO frequency read\n"
+           "  profile <a> <b> [n]   alternate two radio profiles, diffed vs full writes\n"
+           "  hop [n] [hops]        RX LO hops over n frequencies, fastlock vs frequency writes\n"
+           "  sweep <start> <stop> [rate]  spectrum sweep in Hz, sequential vs pipelined\n"
+           "  discover              scan backends given as uri (e.g. ip:usb), probe in parallel, pooled checkout\n"
+           "  config                every uri configured one after another vs concurrently\n"
+           "  streams [s] [core] [prio]  RX on every uri for s seconds, one pinned thread per radio,\n"
+           "                        SCHED_FIFO prio and locked memory when prio > 0\n"
+           "  burst [n] [samples] [trigger]  n triggered RX bursts, re-arm time and burst rate\n"
+           "  supervise [s]         RX through Supervised_Context for s seconds, outages (iiod-sim -d)\n"
+           "  record <path> [s] [block_kib]  RX to SigMF files for s seconds, disk throughput and backlog\n",
+           argv0);
+}
+
+static int bench_context(std::string const& uri, int argc, char **argv)
+{
+    const int runs = 5;
+    Context_Cache cache(argc > 0 ? argv[0] : "/tmp/iioc++-cache");
+
+    double net = 0;
+    bool valid = false;
+    for (int i = 0; i < runs; i++) {
+        Context ctx("uri", uri);
+        net += ctx.creation_latency();
+        auto start = std::chrono::steady_clock::now();
+        valid = cache.validate(ctx, uri);
+        if (!valid) {
+            cache.store(ctx, uri);
+        }
+        if (i == 0) {
+            double check = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            printf("* snapshot %s in %.3f ms\n", valid ? "validated" : "stored", check * 1e3);
+        }
+    }
+
+    double cached = 0;
+    for (int i = 0; i < runs; i++) {
+        Context ctx = cache.load(uri);
+        cached += ctx.creation_latency();
+    }
+    printf("* context creation: network %.3f ms, cached XML %.3f ms offline (mean of %d)\n",
+           net / runs * 1e3, cached / runs * 1e3, runs);
+    return 0;
+}
+
+static int bench_attrs(std::string const& uri, int argc, char **argv)
+{
+    int runs = argc > 0 ? atoi(argv[0]) : 100;
+    if (runs < 1) {
+        return -1;
+    }
+    Context ctx("uri", uri);
+    Device phy = ctx.devices["ad9361-phy"];
+    auto lo = phy.out["altvoltage0"].attributes[ad9361::frequency];
+    long long expected = lo.value();
+
+    double fir = 0, freq = 0;
+    size_t size = 0;
+    for (int i = 0; i < runs; i++) {
+        auto start = std::chrono::steady_clock::now();
+        size = phy.attributes["filter_fir_config"].value().size();
+        auto mid = std::chrono::steady_clock::now();
+        // Gets its own reply only when the long value was read off the link in full
+        long long f = lo.value();
+        fir += std::chrono::duration<double>(mid - start).count();
+        freq += std::chrono::duration<double>(std::chrono::steady_clock::now() - mid).count();
+        if (size <= 512 || f != expected) {
+            throw std::system_error{EPROTO, std::generic_category(), "attribute reply out of sync"};
+        }
+    }
+    printf("* attribute reads: %zu byte filter_fir_config %.3f ms, LO frequency %.3f ms (mean of %d)\n",
+           size, fir / runs * 1e3, freq / runs * 1e3, runs);
+    return 0;
+}
+
+static int bench_profile(std::string const& uri, int argc, char **argv)
+{
+    if (argc < 2) {
+        return -1;
+    }
+    Radio_Profile profiles[2] = {Radio_Profile::load(argv[0]), Radio_Profile::load(argv[1])};
+    int runs = argc > 2 ? atoi(argv[2]) : 10;
+    Context ctx("uri", uri);
+
+    // Full writes: every setting committed on every switch
+    double full = 0;
+    for (int i = 0; i < runs; i++) {
+        Profile_Applier applier(ctx);
+        applier.apply(profiles[i % 2]);
+        auto start = std::chrono::steady_clock::now();
+        Config_Transaction config;
+        for (auto& s : profiles[(i + 1) % 2].settings) {
+            Device dev = ctx.devices[s.device];
+            if (s.channel.empty()) {
+                config.set(dev, s.attr, s.value);
+            } else {
+                config.set(s.output ? dev.out[s.channel] : dev.in[s.channel], s.attr, s.value);
+            }
+        }
+        config.commit();
+        full += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    Profile_Applier applier(ctx);
+    Profile_Report first = applier.apply(profiles[0]);
+    printf("* first apply of %s: %zu written, %zu unchanged in %.3f ms\n",
+           profiles[0].name.c_str(), first.written, first.unchanged, first.latency * 1e3);
+    double diffed = 0;
+    size_t written = 0;
+    for (int i = 1; i <= runs; i++) {
+        Profile_Report r = applier.apply(profiles[i % 2]);
+        for (auto& res : r.results) {
+            if (!res.ok()) {
+                printf("* %s/%s: %s\n", res.target.c_str(), res.key, strerror(-res.err));
+            }
+        }
+        diffed += r.latency;
+        written += r.written;
+    }
+    printf("* profile switch: full %.3f ms, diffed %.3f ms, %.1f writes per switch (mean of %d)\n",
+           full / runs * 1e3, diffed / runs * 1e3, (double)written / runs, runs);
+    return 0;
+}
+
+static int bench_hop(std::string const& uri, int argc, char **argv)
+{
+    int count = argc > 0 ? atoi(argv[0]) : Fastlock_Hopper::SLOTS;
+    int hops = argc > 1 ? atoi(argv[1]) : 100;
+    if (count < 1 || hops < 1) {
+        return -1;
+    }
+    Context ctx("uri", uri);
+    Device phy = ctx.devices["ad9361-phy"];
+    Fastlock_Hopper hopper(phy.out["altvoltage0"]);
+
+    std::vector<long long> freqs;
+    for (int i = 0; i < count; i++) {
+        freqs.push_back(2400000000LL + i * 5000000LL);
+    }
+    auto start = std::chrono::steady_clock::now();
+    hopper.prepare(freqs);
+    double prepare = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("* prepared %zu profiles in %.3f ms\n", hopper.size(), prepare * 1e3);
+
+    // Same pseudo-random hop sequence for both methods
+    unsigned seed = 1;
+    std::vector<long long> sequence;
+    for (int i = 0; i < hops; i++) {
+        seed = seed * 1103515245 + 12345;
+        sequence.push_back(freqs[(seed >> 16) % freqs.size()]);
+    }
+
+    start = std::chrono::steady_clock::now();
+    for (long long f : sequence) {
+        hopper.tune(f);
+    }
+    double tuned = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    for (long long f : sequence) {
+        hopper.hop_to(f);
+    }
+    double hopped = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("* hop latency: frequency write %.3f ms, fastlock %.3f ms (mean of %d)\n",
+           tuned / hops * 1e3, hopped / hops * 1e3, hops);
+    return 0;
+}
+
+static int bench_sweep(std::string const& uri, int argc, char **argv)
+{
+    if (argc < 2) {
+        return -1;
+    }
+    Sweep_Config config{atoll(argv[0]), atoll(argv[1]), argc > 2 ? atoll(argv[2]) : 30720000LL};
+    Context ctx("uri", uri);
+    Device phy = ctx.devices["ad9361-phy"];
+    Device rx = ctx.devices["cf-ad9361-lpc"];
+
+    Config_Transaction setup;
+    setup.set(phy.in["voltage0"], ad9361::sampling_frequency, config.sample_rate);
+    setup.set(phy.in["voltage0"], ad9361::rf_bandwidth, config.sample_rate);
+    for (auto& r : setup.commit()) {
+        if (!r.ok()) {
+            throw std::system_error{-r.err, std::generic_category(), r.target + " " + r.key};
+        }
+    }
+    rx.in[0].enable();
+    rx.in[1].enable();
+
+    for (bool pipelined : {false, true}) {
+        config.pipelined = pipelined;
+        Sweep_Engine engine(phy.out["altvoltage0"], rx, config);
+        Sweep_Result r = engine.run();
+        size_t peak = std::max_element(r.power.begin(), r.power.end()) - r.power.begin();
+        printf("* %s: %.1f MHz/s, %zu steps over %.1f MHz in %.3f s "
+               "(capture %.3f s, fft %.3f s), peak %.3f MHz at %.1f dBFS\n",
+               pipelined ? "pipelined" : "sequential", r.rate(), r.steps, r.span() / 1e6, r.seconds,
+               r.capture_seconds, r.process_seconds, (r.start + peak * r.bin_width) / 1e6, r.power[peak]);
+    }
+    return 0;
+}
+
+static void stage_config(Context& ctx, size_t radio, Config_Transaction& config)
+{
+    using namespace Hz;
+    Device phy = ctx.devices["ad9361-phy"];
+    config.set(phy.in["voltage0"], ad9361::rf_port_select, "A_BALANCED");
+    config.set(phy.out["altvoltage0"], ad9361::frequency, 2.4_GHz + (long long)radio * 20_MHz);
+    config.set(phy.in["voltage0"], ad9361::rf_bandwidth, 2_MHz);
+    config.set(phy.in["voltage0"], ad9361::sampling_frequency, 2.5_MHz);
+    config.set(phy.out["voltage0"], ad9361::rf_bandwidth, 2_MHz);
+    config.set(phy.out["altvoltage1"], ad9361::frequency, 2.5_GHz + (long long)radio * 20_MHz);
+}
+
+static int bench_config(std::string const& uris)
+{
+    std::vector<std::string> list;
+    std::stringstream ss(uris);
+    std::string uri;
+    while (std::getline(ss, uri, ',')) {
+        list.push_back(uri);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Context> contexts;
+    for (auto& f : open_all(list)) {
+        contexts.push_back(f.get());
+    }
+    double opened = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::vector<Context*> radios;
+    for (auto& c : contexts) {
+        radios.push_back(&c);
+    }
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < contexts.size(); i++) {
+        Config_Transaction config;
+        stage_config(contexts[i], i, config);
+        config.commit();
+    }
+    double serial = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    double slowest = 0;
+    for (auto& f : configure_all(radios, stage_config)) {
+        Radio_Config_Result r = f.get();
+        slowest = std::max(slowest, r.seconds);
+        if (!r.ok()) {
+            printf("* %s: configuration failed\n", list[r.radio].c_str());
+        }
+    }
+    double parallel = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("* %zu contexts opened concurrently in %.3f ms\n", contexts.size(), opened * 1e3);
+    printf("* configuration: serial %.3f ms, concurrent %.3f ms, slowest radio %.3f ms\n",
+           serial * 1e3, parallel * 1e3, slowest * 1e3);
+    return 0;
+}
+
+static int bench_discover(std::string const& backends)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Scan_Result> found = scan_contexts(backends.c_str());
+    double scanned = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("* scan found %zu contexts in %.3f ms\n", found.size(), scanned * 1e3);
+
+    std::vector<std::string> uris;
+    for (auto& f : found) {
+        uris.push_back(f.uri);
+    }
+    Context_Pool pool;
+    start = std::chrono::steady_clock::now();
+    double serial = 0;
+    for (auto& p : pool.warm(uris)) {
+        serial += p.latency;
+        printf("* %s: %s in %.3f ms\n", p.uri.c_str(), p.err ? strerror(p.err) : "ok", p.latency * 1e3);
+    }
+    double parallel = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("* probe: parallel %.3f ms, sum of probes %.3f ms\n", parallel * 1e3, serial * 1e3);
+
+    for (auto& uri : uris) {
+        if (pool.idle_count(uri) == 0) {
+            continue;
+        }
+        start = std::chrono::steady_clock::now();
+        {
+            Context_Pool::Lease lease = pool.checkout(uri);
+        }
+        double pooled = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("* %s: pooled checkout %.3f ms\n", uri.c_str(), pooled * 1e3);
+    }
+    return 0;
+}
+
+static int bench_streams(std::string const& uris, int argc, char **argv)
+{
+    double seconds = argc > 0 ? atof(argv[0]) : 5;
+    int core = argc > 1 ? atoi(argv[1]) : 0;
+    int priority = argc > 2 ? atoi(argv[2]) : 0;
+    int cores = std::thread::hardware_concurrency();
+
+    std::vector<Radio_Stream_Config> radios;
+    std::stringstream list(uris);
+    std::string uri;
+    while (std::getline(list, uri, ',')) {
+        Radio_Stream_Config r;
+        r.uri = uri;
+        r.rx_realtime.core = cores > 0 ? (core + radios.size()) % cores : -1;
+        r.rx_realtime.priority = priority;
+        r.rx_realtime.lock_memory = priority > 0;
+        r.rx_realtime.prefault = true;
+        radios.push_back(r);
+    }
+
+    Stream_Manager manager(radios);
+    manager.start();
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    manager.stop();
+
+    for (auto& s : manager.stats()) {
+        printf("* %s %s core %d: %.3f MS/s, %.3f MB/s, %llu gaps, %llu samples lost%s%s\n", radios[s.radio].uri.c_str(),
+               s.output ? "tx" : "rx", s.core, s.samples_per_second() / 1e6, s.bytes_per_second() / 1e6,
+               (unsigned long long)s.gaps, (unsigned long long)s.lost, s.error.empty() ? "" : ", ", s.error.c_str());
+        printf("  affinity %s, SCHED_FIFO %s, mlockall %s, prefault %s\n",
+               Realtime_Report::describe(s.realtime.affinity), Realtime_Report::describe(s.realtime.priority),
+               Realtime_Report::describe(s.realtime.locked), Realtime_Report::describe(s.realtime.prefaulted));
+    }
+    Stream_Stats total = manager.total();
+    printf("* total: %.3f MS/s, %.3f MB/s over %zu radios\n",
+           total.samples_per_second() / 1e6, total.bytes_per_second() / 1e6, radios.size());
+    return 0;
+}
+
+static int bench_burst(std::string const& uri, int argc, char **argv)
+{
+    int count = argc > 0 ? atoi(argv[0]) : 1000;
+    Burst_Config config;
+    config.samples = argc > 1 ? atoi(argv[1]) : 4096;
+    config.trigger = argc > 2 ? argv[2] : "";
+
+    Context ctx("uri", uri);
+    Burst_Capture capture(ctx, config);
+    for (int i = 0; i < count; i++) {
+        capture.capture();
+    }
+    Burst_Stats s = capture.stats();
+    printf("* %llu bursts of %zu samples: %.1f bursts/s, interval %.3f/%.3f/%.3f ms (min/mean/max)\n",
+           (unsigned long long)s.bursts, config.samples, s.rate(),
+           s.min_interval * 1e3, s.mean_interval * 1e3, s.max_interval * 1e3);
+    printf("* re-arm %.1f us mean, %.1f us max, waiting for the trigger %.3f ms mean\n",
+           s.mean_rearm * 1e6, s.max_rearm * 1e6, s.mean_wait * 1e3);
+    return 0;
+}
+
+static int bench_supervise(std::string const& uri, int argc, char **argv)
+{
+    double seconds = argc > 0 ? atof(argv[0]) : 5;
+    Supervisor_Config config;
+    config.uri = uri;
+    config.timeout = std::chrono::milliseconds(1000);
+    config.retry = std::chrono::milliseconds(50);
+    config.wait = std::chrono::milliseconds(5000);
+
+    Supervised_Context radio(config);
+    radio.set("ad9361-phy/in/voltage0/hardwaregain", "30");
+    radio.set("ad9361-phy/out/altvoltage0/frequency", "2400000000");
+    size_t rx = radio.add_buffer("cf-ad9361-lpc", {"voltage0", "voltage1"});
+
+    uint64_t samples = 0;
+    uint64_t errors = 0;
+    auto end = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+    while (std::chrono::steady_clock::now() < end) {
+        ssize_t ret = radio.refill(rx);
+        if (ret < 0) {
+            errors++;
+        } else {
+            samples += radio.buffer(rx).end() - radio.buffer(rx).begin();
+        }
+    }
+
+    for (auto& o : radio.outages()) {
+        printf("* outage after %s (%s): %.3f ms, %zu attempts, %zu settings replayed, %zu unchanged\n",
+               o.cause.c_str(), strerror(o.err), o.seconds() * 1e3, o.attempts, o.replay.written, o.replay.unchanged);
+    }
+    printf("* %llu reconnects, %llu samples, %llu failed refills\n", (unsigned long long)radio.reconnects(),
+           (unsigned long long)samples, (unsigned long long)errors);
+    return 0;
+}
+
+static int bench_record(std::string const& uri, int argc, char **argv)
+{
+    if (argc < 1) {
+        return -1;
+    }
+    double seconds = argc > 1 ? atof(argv[1]) : 5;
+    Recorder_Config config;
+    config.path = argv[0];
+    config.block_size = argc > 2 ? atoi(argv[2]) * 1024 : 1 << 20;
+    {
+        Context ctx("uri", uri);
+        config.describe(ctx);
+    }
+
+    Radio_Stream_Config radio;
+    radio.uri = uri;
+    radio.sample_rate = config.sample_rate;
+    Recorder recorder(config);
+    Stream_Manager manager({radio});
+    manager.start([&](size_t, Buffer& buf, uint64_t index) { recorder.append(buf, index); });
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    manager.stop();
+    recorder.close();
+
+    Stream_Stats rx = manager.total();
+    Recorder_Stats s = recorder.stats();
+    printf("* rx %.3f MB/s, %llu gaps; disk %.3f MB/s via %s%s, %llu files\n",
+           rx.bytes_per_second() / 1e6, (unsigned long long)rx.gaps, s.bytes_per_second() / 1e6,
+           s.uring ? "io_uring" : "pwrite thread", s.direct ? " O_DIRECT" : "", (unsigned long long)s.files);
+    printf("* backlog %zu of %zu blocks max, %llu of %llu samples dropped%s%s\n",
+           s.max_backlog, config.blocks, (unsigned long long)s.dropped,
+           (unsigned long long)(s.samples + s.dropped), s.error ? ", " : "", s.error ? strerror(s.error) : "");
+    return 0;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc < 3) {
+        usage(argv[0]);
+        return 1;
+    }
+    std::string uri = argv[1];
+    std::string test = argv[2];
+
+    try {
+        if (test == "context") {
+            return bench_context(uri, argc - 3, argv + 3);
+        }
+        if (test == "discover") {
+            return bench_discover(uri);
+        }
+        if (test == "config") {
+            return bench_config(uri);
+        }
+        if (test == "streams") {
+            return bench_streams(uri, argc - 3, argv + 3);
+        }
+        if (test == "burst") {
+            return bench_burst(uri, argc - 3, argv + 3);
+        }
+        if (test == "supervise") {
+            return bench_supervise(uri, argc - 3, argv + 3);
+        }
+        if (test == "record" && bench_record(uri, argc - 3, argv + 3) == 0) {
+            return 0;
+        }
+        if (test == "sweep" && bench_sweep(uri, argc - 3, argv + 3) == 0) {
+            return 0;
+        }
+        if (test == "attrs" && bench_attrs(uri, argc - 3, argv + 3) == 0) {
+            return 0;
+        }
+        if (test == "hop" && bench_hop(uri, argc - 3, argv + 3) == 0) {
+            return 0;
+        }
+        if (test == "profile" && bench_profile(uri, argc - 3, argv + 3) == 0) {
+            return 0;
+        }
+    } catch (std::system_error& e) {
+        std::cerr << "iio-bench: " << e.what() << std::endl;
+        return 1;
+    }
+    usage(argv[0]);
+    return 1;
+}
@@ -1,11 +1,35 @@
+#pragma once
+
 #include "iio.h"
 #include <complex>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <cassert>
 #include <cerrno>
+#include <cctype>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <fstream>
+#include <sstream>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <locale.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 const int MAXATRLENGTH = 128;
+// Upper bound for attribute values read by value(), FIR configs and
+// calibration tables run to several kilobytes
+const size_t MAXATRBUFFER = 1 << 20;
 namespace Hz{
     long long operator"" _MHz(unsigned long long x) {
         return ((long long)x*1000000.0 + .5);
@@ -34,12 +58,441 @@ class Channel_Attribute;
 class Device_Attributes;
 class Channel_Attributes;
 class Context_Devices;
+class Context_Cache;
+class Config_Transaction;
+class Profile_Applier;
+class Fastlock_Hopper;
+class Sweep_Engine;
+class Stream_Layout;
+class Context_Executor;
+class Cancellation_Token;
+
+/*
+ * Attribute values of one device or channel, all refreshed by a single
+ * iio_*_attr_read_all round-trip once older than max_age. Caching is off
+ * while max_age is zero; writes through the attribute accessors invalidate.
+ */
+struct Attribute_Cache {
+    std::chrono::steady_clock::duration max_age{0};
+    std::chrono::steady_clock::time_point refreshed;
+    bool valid = false;
+    // Keys are the attribute names owned by libiio
+    std::unordered_map<std::string_view, std::string> values;
+
+    bool enabled() const {
+        return max_age.count() > 0;
+    }
+
+    bool fresh() const {
+        return valid && std::chrono::steady_clock::now() - refreshed < max_age;
+    }
+};
+
+/*
+ * Name index built once per Context. Keys are views of the names owned by
+ * libiio, so lookups hash the caller's string without allocating. Device
+ * and channel entries are attached with iio_device_set_data and
+ * iio_channel_set_data.
+ */
+// Static description of a channel, read once when the index is built
+struct Channel_Info {
+    const char* id;
+    const char* name;           // nullptr when the channel has none
+    long index;                 // scan index, -1 when not a scan element
+    bool output;
+    bool scan_element;
+    iio_chan_type type;
+    iio_modifier modifier;
+    iio_data_format format;
+};
+
+Channel_Info describe_channel(iio_channel* chn) {
+    return Channel_Info{iio_channel_get_id(chn), iio_channel_get_name(chn), iio_channel_get_index(chn),
+                        iio_channel_is_output(chn), iio_channel_is_scan_element(chn),
+                        iio_channel_get_type(chn), iio_channel_get_modifier(chn),
+                        *iio_channel_get_data_format(chn)};
+}
+
+struct Channel_Index {
+    iio_channel* chn;
+    std::unordered_map<std::string_view, const char*> attrs;
+    Attribute_Cache cache;
+    Channel_Info info;
+};
+
+struct Device_Index {
+    iio_device* dev;
+    std::unordered_map<std::string_view, iio_channel*> in_names, out_names;
+    std::vector<iio_channel*> in, out;
+    std::unordered_map<std::string_view, const char*> attrs;
+    Attribute_Cache cache;
+    unsigned int kernel_buffers = 4;    // last count set through Device, libiio cannot read it back
+};
+
+struct Context_Index {
+    std::vector<Device_Index> devices;
+    std::vector<Channel_Index> channels;
+    std::unordered_map<std::string_view, iio_device*> names;
+
+    void build(iio_context* ctx);
+};
+
+Attribute_Cache* device_attr_cache(iio_device* dev) {
+    auto idx = (Device_Index*)iio_device_get_data(dev);
+    return idx ? &idx->cache : nullptr;
+}
+
+Attribute_Cache* channel_attr_cache(iio_channel* chn) {
+    auto idx = (Channel_Index*)iio_channel_get_data(chn);
+    return idx ? &idx->cache : nullptr;
+}
+
+void invalidate_device_attrs(iio_device* dev) {
+    if (auto cache = device_attr_cache(dev)) {
+        cache->valid = false;
+    }
+}
+
+void invalidate_channel_attrs(iio_channel* chn) {
+    if (auto cache = channel_attr_cache(chn)) {
+        cache->valid = false;
+    }
+}
+
+void refresh_device_attrs(iio_device* dev, Attribute_Cache* cache) {
+    int err = iio_device_attr_read_all(dev, [](iio_device*, const char* attr, const char* val, size_t len, void* d) {
+        ((Attribute_Cache*)d)->values[attr].assign(val, strnlen(val, len));
+        return 0;
+    }, cache);
+    if (err < 0) {
+        throw std::system_error{-err, std::generic_category(), "device attribute read error"};
+    }
+    cache->refreshed = std::chrono::steady_clock::now();
+    cache->valid = true;
+}
+
+void refresh_channel_attrs(iio_channel* chn, Attribute_Cache* cache) {
+    int err = iio_channel_attr_read_all(chn, [](iio_channel*, const char* attr, const char* val, size_t len, void* d) {
+        ((Attribute_Cache*)d)->values[attr].assign(val, strnlen(val, len));
+        return 0;
+    }, cache);
+    if (err < 0) {
+        throw std::system_error{-err, std::generic_category(), "channel attribute read error"};
+    }
+    cache->refreshed = std::chrono::steady_clock::now();
+    cache->valid = true;
+}
+
+// Cached value of attr, refreshed when stale; nullptr when caching is off
+const std::string* cached_device_attr(iio_device* dev, const char* attr) {
+    auto cache = device_attr_cache(dev);
+    if (cache == nullptr || !cache->enabled()) {
+        return nullptr;
+    }
+    if (!cache->fresh()) {
+        refresh_device_attrs(dev, cache);
+    }
+    auto it = cache->values.find(attr);
+    return it == cache->values.end() ? nullptr : &it->second;
+}
+
+const std::string* cached_channel_attr(iio_channel* chn, const char* attr) {
+    auto cache = channel_attr_cache(chn);
+    if (cache == nullptr || !cache->enabled()) {
+        return nullptr;
+    }
+    if (!cache->fresh()) {
+        refresh_channel_attrs(chn, cache);
+    }
+    auto it = cache->values.find(attr);
+    return it == cache->values.end() ? nullptr : &it->second;
+}
+
+// libiio-owned name of attribute s, throws if the device has none
+const char* find_device_attr(iio_device* dev, std::string_view s) {
+    const char* key = nullptr;
+    if (auto idx = (Device_Index*)iio_device_get_data(dev)) {
+        auto it = idx->attrs.find(s);
+        key = it == idx->attrs.end() ? nullptr : it->second;
+    } else {
+        key = iio_device_find_attr(dev, std::string(s).c_str());
+    }
+    if (key == nullptr) {
+        throw std::system_error{ENOENT, std::generic_category(), "device attribute not found"};
+    }
+    return key;
+}
+
+// libiio-owned name of attribute s, throws if the channel has none
+const char* find_channel_attr(iio_channel* chn, std::string_view s) {
+    const char* key = nullptr;
+    if (auto idx = (Channel_Index*)iio_channel_get_data(chn)) {
+        auto it = idx->attrs.find(s);
+        key = it == idx->attrs.end() ? nullptr : it->second;
+    } else {
+        key = iio_channel_find_attr(chn, std::string(s).c_str());
+    }
+    if (key == nullptr) {
+        throw std::system_error{ENOENT, std::generic_category(), "channel attribute not found"};
+    }
+    return key;
+}
+
+// Locale libiio formats and parses doubles in, whatever the process locale
+locale_t c_locale() {
+    static locale_t loc = newlocale(LC_ALL_MASK, "C", (locale_t)0);
+    return loc;
+}
+
+double parse_double(const char* str, char** end) {
+    locale_t old = uselocale(c_locale());
+    double val = strtod(str, end);
+    uselocale(old);
+    return val;
+}
+
+// Parses a cached value the way iio_*_attr_read_{longlong,double,bool} do
+template <typename T>
+T parse_attribute(std::string const& str, const char* what) {
+    char* end;
+    T val{};
+    if constexpr (std::is_same_v<T, std::string>) {
+        return str;
+    } else if constexpr (std::is_same_v<T, double>) {
+        val = parse_double(str.c_str(), &end);
+    } else {
+        val = strtoll(str.c_str(), &end, 0);
+    }
+    if (end == str.c_str()) {
+        throw std::system_error{EINVAL, std::generic_category(), what};
+    }
+    return val;
+}
+
+/*
+ * The local backend fills a buffer too small for the value and returns its
+ * length. iiod clients (network, usb, serial) fail with -EIO instead and
+ * leave the value unread on the link, where the next command would take it
+ * for its reply, so they must only be given buffers the value fits in.
+ */
+bool fills_attr_buffer(const iio_device* dev) {
+    return strcmp(iio_context_get_name(iio_device_get_context(dev)), "local") == 0;
+}
+
+bool fills_attr_buffer(const iio_channel* chn) {
+    return fills_attr_buffer(iio_channel_get_device(chn));
+}
+
+/*
+ * Reads an attribute into a caller buffer. The count libiio returns includes
+ * the terminating NUL, so a value may use the whole buffer. The local
+ * backend returns the same count for a value that exactly fits and one it
+ * cut short, which a read one byte longer tells apart. Over iiod a value
+ * longer than the buffer breaks the connection; size dst for the value.
+ */
+template <typename Read>
+std::string_view read_attribute(Read read, char* dst, size_t len, bool fills, const char* what) {
+    ssize_t ret = read(dst, len);
+    if (ret >= 0 && fills && (size_t)ret == len) {
+        std::string probe(len + 1, '\0');
+        ret = read(&probe[0], probe.size());
+        if (ret >= 0 && (size_t)ret <= len) {
+            memcpy(dst, probe.data(), ret);
+        }
+    }
+    if (ret >= 0 && ((size_t)ret > len || strnlen(dst, len) == len)) {
+        ret = -EMSGSIZE;
+    }
+    if (ret < 0) {
+        throw std::system_error{(int)-ret, std::generic_category(), what};
+    }
+    return std::string_view(dst, strnlen(dst, len));
+}
+
+/*
+ * Reads an attribute of any length. The local backend reads on the stack
+ * first and again on the heap while the value fills the buffer; iiod clients
+ * read once into a buffer of MAXATRBUFFER, which libiio only fills as far
+ * as the value goes.
+ */
+template <typename Read>
+std::string read_attribute(Read read, bool fills, const char* what) {
+    if (!fills) {
+        std::unique_ptr<char[]> buf(new char[MAXATRBUFFER]);
+        ssize_t ret = read(buf.get(), MAXATRBUFFER);
+        if (ret < 0) {
+            throw std::system_error{(int)-ret, std::generic_category(), what};
+        }
+        return std::string(buf.get(), strnlen(buf.get(), std::min((size_t)ret, MAXATRBUFFER)));
+    }
+    char tmp[MAXATRLENGTH];
+    ssize_t ret = read(tmp, sizeof(tmp));
+    if (ret >= 0 && (size_t)ret < sizeof(tmp)) {
+        return std::string(tmp, strnlen(tmp, sizeof(tmp)));
+    }
+    std::string buf;
+    for (size_t len = 4 * sizeof(tmp); ret >= 0 && len <= MAXATRBUFFER; len *= 4) {
+        buf.resize(len);
+        ret = read(&buf[0], len);
+        if (ret >= 0 && (size_t)ret < len) {
+            buf.resize(strnlen(buf.data(), len));
+            return buf;
+        }
+    }
+    throw std::system_error{ret < 0 ? (int)-ret : EMSGSIZE, std::generic_category(), what};
+}
+
+/*
+ * Attribute descriptor with the key and value type fixed at compile time,
+ * e.g. ad9361::frequency. Indexing attributes with a descriptor yields a
+ * typed accessor that calls the matching iio_*_attr_{read,write}_* function
+ * directly: no key lookup, no string building, one operator=.
+ */
+template <typename T>
+struct Attr {
+    static_assert(std::is_same_v<T, long long> || std::is_same_v<T, double>
+        || std::is_same_v<T, bool> || std::is_same_v<T, std::string>,
+        "attribute type must be long long, double, bool or std::string");
+    // String attributes are written from C strings, never std::string
+    using arg_type = std::conditional_t<std::is_same_v<T, std::string>, const char*, T>;
+    const char* key;
+};
+
+template <typename T>
+class Typed_Device_Attribute {
+    iio_device* dev;
+public:
+    const char* key;
+    constexpr Typed_Device_Attribute(iio_device* device, const char* str) : dev(device), key(str) {
+    }
+
+    Typed_Device_Attribute& operator =(typename Attr<T>::arg_type val) {
+        int err;
+        if constexpr (std::is_same_v<T, bool>) {
+            err = iio_device_attr_write_bool(dev, key, val);
+        } else if constexpr (std::is_same_v<T, long long>) {
+            err = iio_device_attr_write_longlong(dev, key, val);
+        } else if constexpr (std::is_same_v<T, double>) {
+            err = iio_device_attr_write_double(dev, key, val);
+        } else {
+            err = iio_device_attr_write(dev, key, val);
+        }
+        invalidate_device_attrs(dev);
+        if (err < 0) {
+            throw std::system_error{-err, std::generic_category(), "device attribute write error"};
+        }
+        return *this;
+    }
+
+    T value() const {
+        if (auto cached = cached_device_attr(dev, key)) {
+            return parse_attribute<T>(*cached, "device attribute read error");
+        }
+        int err;
+        T val{};
+        if constexpr (std::is_same_v<T, bool>) {
+            err = iio_device_attr_read_bool(dev, key, &val);
+        } else if constexpr (std::is_same_v<T, long long>) {
+            err = iio_device_attr_read_longlong(dev, key, &val);
+        } else if constexpr (std::is_same_v<T, double>) {
+            err = iio_device_attr_read_double(dev, key, &val);
+        } else {
+            return read_attribute([this](char* dst, size_t len) {
+                return iio_device_attr_read(dev, key, dst, len);
+            }, fills_attr_buffer(dev), "device attribute read error");
+        }
+        if (err < 0) {
+            throw std::system_error{-err, std::generic_category(), "device attribute read error"};
+        }
+        return val;
+    }
+};
+
+template <typename T>
+class Typed_Channel_Attribute {
+    iio_channel* chn;
+public:
+    const char* key;
+    constexpr Typed_Channel_Attribute(iio_channel* channel, const char* str) : chn(channel), key(str) {
+    }
+
+    Typed_Channel_Attribute& operator =(typename Attr<T>::arg_type val) {
+        int err;
+        if constexpr (std::is_same_v<T, bool>) {
+            err = iio_channel_attr_write_bool(chn, key, val);
+        } else if constexpr (std::is_same_v<T, long long>) {
+            err = iio_channel_attr_write_longlong(chn, key, val);
+        } else if constexpr (std::is_same_v<T, double>) {
+            err = iio_channel_attr_write_double(chn, key, val);
+        } else {
+            err = iio_channel_attr_write(chn, key, val);
+        }
+        invalidate_channel_attrs(chn);
+        if (err < 0) {
+            throw std::system_error{-err, std::generic_category(), "channel attribute write error"};
+        }
+        return *this;
+    }
+
+    T value() const {
+        if (auto cached = cached_channel_attr(chn, key)) {
+            return parse_attribute<T>(*cached, "channel attribute read error");
+        }
+        int err;
+        T val{};
+        if constexpr (std::is_same_v<T, bool>) {
+            err = iio_channel_attr_read_bool(chn, key, &val);
+        } else if constexpr (std::is_same_v<T, long long>) {
+            err = iio_channel_attr_read_longlong(chn, key, &val);
+        } else if constexpr (std::is_same_v<T, double>) {
+            err = iio_channel_attr_read_double(chn, key, &val);
+        } else {
+            return read_attribute([this](char* dst, size_t len) {
+                return iio_channel_attr_read(chn, key, dst, len);
+            }, fills_attr_buffer(chn), "channel attribute read error");
+        }
+        if (err < 0) {
+            throw std::system_error{-err, std::generic_category(), "channel attribute read error"};
+        }
+        return val;
+    }
+};
+
+// Common attributes of the ad9361-phy device and its channels
+namespace ad9361 {
+    // altvoltage0 (RX_LO) and altvoltage1 (TX_LO)
+    inline constexpr Attr<long long> frequency{"frequency"};
+    inline constexpr Attr<bool> powerdown{"powerdown"};
+    inline constexpr Attr<bool> external{"external"};
+    inline constexpr Attr<long long> fastlock_store{"fastlock_store"};
+    inline constexpr Attr<long long> fastlock_recall{"fastlock_recall"};
+    // fastlock_save takes a slot number and reads back "<slot> <profile bytes>"
+    inline constexpr Attr<long long> fastlock_save_slot{"fastlock_save"};
+    inline constexpr Attr<std::string> fastlock_save{"fastlock_save"};
+    inline constexpr Attr<std::string> fastlock_load{"fastlock_load"};
+
+    // voltage0 input and output
+    inline constexpr Attr<long long> rf_bandwidth{"rf_bandwidth"};
+    inline constexpr Attr<long long> sampling_frequency{"sampling_frequency"};
+    inline constexpr Attr<double> hardwaregain{"hardwaregain"};
+    inline constexpr Attr<std::string> rf_port_select{"rf_port_select"};
+    inline constexpr Attr<std::string> gain_control_mode{"gain_control_mode"};
+    inline constexpr Attr<double> rssi{"rssi"};
+
+    // temp0 input, millidegrees Celsius
+    inline constexpr Attr<long long> input{"input"};
+
+    // device attributes
+    inline constexpr Attr<std::string> ensm_mode{"ensm_mode"};
+    inline constexpr Attr<std::string> calib_mode{"calib_mode"};
+    inline constexpr Attr<long long> xo_correction{"xo_correction"};
+}
 
 class Device_Attribute {
-    Device *dev;
+    iio_device *dev;
 public:
-    std::string key;
-    Device_Attribute (std::string str, Device *device) {
+    const char* key;
+    Device_Attribute (const char* str, iio_device *device) {
         key = str;
         dev = device;
     }
@@ -49,56 +502,188 @@ public:
     Device_Attribute& operator =(double str);
     Device_Attribute& operator =(bool str);
     std::string value();
+    // Reads into dst without allocating, the view is valid while dst is
+    std::string_view read(char* dst, size_t len);
+    // Typed read: long long, double or bool, parsed by libiio
+    template <typename T>
+    T as();
 };
 
 class Device_Attributes {
-    Device* a;
+    iio_device* a;
 public:
-    Device_Attributes(Device* b) {
+    Device_Attributes(iio_device* b) {
         a = b;
     }
     int size();
     std::string operator[] (unsigned int i);
-    Device_Attribute operator[] (std::string s);
+    Device_Attribute operator[] (std::string_view s);
+    template <typename T>
+    Typed_Device_Attribute<T> operator[] (Attr<T> attr);
+    // Serve reads from values at most max_age old, zero disables the cache
+    void set_cache(std::chrono::steady_clock::duration max_age);
+    // Re-read all attributes in one round-trip
+    void refresh();
+    void invalidate();
 };
 
 class Device_Channels {
-    Device* a;
+    iio_device* a;
     bool out;
 public:
-    Device_Channels(Device* b, bool outc) {
+    Device_Channels(iio_device* b, bool outc) {
         a = b;
         out = outc;
     }
-    int size();
-    Channel operator[] (std::string s);
+    int size() const;
+    Channel operator[] (unsigned int i) const;
+    Channel operator[] (std::string_view s) const;
+
+    class iterator {
+        Device_Channels const* chs;
+        unsigned int i;
+    public:
+        iterator(Device_Channels const* c, unsigned int j) : chs(c), i(j) {
+        }
+        Channel operator*() const;
+        iterator& operator++() {
+            i++;
+            return *this;
+        }
+        bool operator!=(iterator const& b) const {
+            return i != b.i;
+        }
+    };
+
+    iterator begin() const {
+        return iterator(this, 0);
+    }
+
+    iterator end() const {
+        return iterator(this, size());
+    }
 };
 
+/*
+ * Devices, channels and their accessors are handles over the libiio
+ * pointers, with no pointers back into the owning object: copies are cheap
+ * and stay valid for the life of the Context.
+ */
 class Device {
     iio_device *dev;
 public:
     friend Buffer;
-    friend Device_Attributes;
-    friend Device_Attribute;
-    friend Device_Channels;
+    friend Config_Transaction;
+    friend Sweep_Engine;
+    friend Stream_Layout;
+    friend Context_Executor;
     Device_Channels in;
     Device_Channels out;
     Device_Attributes attributes;
-    Device(iio_device* device) : attributes(this), in(this, false), out(this, true) {
-        dev = device;
+    Device(iio_device* device) : dev(device), in(device, false), out(device, true), attributes(device) {
     }
     size_t sample_size() {
         return iio_device_get_sample_size(dev);
     }
+    // Debug registers, e.g. the status register of an ADI HDL core
+    uint32_t reg_read(uint32_t address) {
+        uint32_t value;
+        int err = iio_device_reg_read(dev, address, &value);
+        if (err < 0) {
+            throw std::system_error{-err, std::generic_category(), "register read error"};
+        }
+        return value;
+    }
+    void reg_write(uint32_t address, uint32_t value) {
+        int err = iio_device_reg_write(dev, address, value);
+        if (err < 0) {
+            throw std::system_error{-err, std::generic_category(), "register write error"};
+        }
+    }
+    bool is_trigger() const {
+        return iio_device_is_trigger(dev);
+    }
+    // Trigger bound to this device, none when it has none
+    std::optional<Device> trigger() const;
+    void set_trigger(Device const& trigger);
+    void clear_trigger();
+    // Blocks the kernel queues ahead of refill(), libiio's default is 4
+    void set_kernel_buffers(unsigned int count) {
+        int err = iio_device_set_kernel_buffers_count(dev, count);
+        if (err < 0) {
+            throw std::system_error{-err, std::generic_category(), "kernel buffers count not set"};
+        }
+        if (auto idx = (Device_Index*)iio_device_get_data(dev)) {
+            idx->kernel_buffers = count;
+        }
+    }
+    // Count last set through set_kernel_buffers, else libiio's default
+    unsigned int kernel_buffers() const {
+        auto idx = (Device_Index*)iio_device_get_data(dev);
+        return idx ? idx->kernel_buffers : 4;
+    }
     std::string id();
     std::string name();
-    Channel find_channel(std::string s, bool output);
+    Channel find_channel(std::string_view s, bool output);
 };
 
+/*
+ * Samples of an I/Q buffer as complex int16, voltage1 (Q) in real() and
+ * voltage0 (I) in imag(). The two lowest enabled 16-bit channels are I and
+ * Q wherever the sample layout puts them, and an enabled timestamp channel
+ * is copied out in the same pass, so timestamps()[i] is the time of sample
+ * i without a per-sample iio_channel_read.
+ */
 class Buffer {
     iio_buffer* a;
     std::vector<std::complex<int16_t>> v;
+    std::vector<int64_t> ts;
+    ptrdiff_t i_offset = 0;
+    ptrdiff_t q_offset = 2;
+    ptrdiff_t ts_offset = -1;       // -1 without a timestamp channel
+
+    void locate(iio_device* dev);
+
+    // One pass over the buffer with every offset fixed for the loop
+    template <bool stamped>
+    void convert_in() {
+        const char* p = (const char*)iio_buffer_start(a);
+        ptrdiff_t step = iio_buffer_step(a);
+        size_t n = std::min(v.size(), (size_t)(((const char*)iio_buffer_end(a) - p) / step));
+        std::complex<int16_t>* out = v.data();
+        int64_t* stamps = ts.data();
+        for (size_t i = 0; i < n; i++, p += step) {
+            int16_t re, im;
+            memcpy(&re, p + q_offset, sizeof(re));
+            memcpy(&im, p + i_offset, sizeof(im));
+            out[i] = std::complex<int16_t>(re, im);
+            if constexpr (stamped) {
+                memcpy(&stamps[i], p + ts_offset, sizeof(stamps[i]));
+            }
+        }
+    }
+
+    void convert_in() {
+        if (ts_offset >= 0) {
+            convert_in<true>();
+        } else {
+            convert_in<false>();
+        }
+    }
+
+    void convert_out() {
+        char* p = (char*)iio_buffer_start(a);
+        ptrdiff_t step = iio_buffer_step(a);
+        size_t n = std::min(v.size(), (size_t)(((char*)iio_buffer_end(a) - p) / step));
+        const std::complex<int16_t>* in = v.data();
+        for (size_t i = 0; i < n; i++, p += step) {
+            int16_t re = in[i].real(), im = in[i].imag();
+            memcpy(p + q_offset, &re, sizeof(re));
+            memcpy(p + i_offset, &im, sizeof(im));
+        }
+    }
 public:
+    friend Cancellation_Token;
     ptrdiff_t step() const{
         return iio_buffer_step(a);
     }
@@ -109,19 +694,48 @@ public:
         if ((a = iio_device_create_buffer(dev.dev, samples_count, cyclic)) == nullptr) {
             throw std::system_error{errno, std::generic_category(), "buffer not created"};
         }
-        
-        int i = 0;
-        for (auto t_dat = (char *)iio_buffer_start(a); t_dat < iio_buffer_end(a); t_dat += iio_buffer_step(a)) {
-		    //v.push_back(std::complex<int16_t>());
-			v[i] = std::complex<int16_t>(((int16_t*)t_dat)[1], ((int16_t*)t_dat)[0]);
-			i++;
-		}
-		assert(this->step() == sizeof(int16_t) * 2);
+        try {
+            locate(dev.dev);
+        } catch (...) {
+            iio_buffer_destroy(a);
+            throw;
+        }
+        if (ts_offset >= 0) {
+            ts.resize(samples_count);
+        }
+        convert_in();
+    }
+
+    // Move-only: the buffer owns its iio_buffer
+    Buffer(const Buffer&) = delete;
+    Buffer& operator =(const Buffer&) = delete;
+
+    Buffer(Buffer&& b) noexcept
+        : a(std::exchange(b.a, nullptr)), v(std::move(b.v)), ts(std::move(b.ts)),
+          i_offset(b.i_offset), q_offset(b.q_offset), ts_offset(b.ts_offset)
+    {
+    }
+
+    Buffer& operator =(Buffer&& b) noexcept {
+        if (this != &b) {
+            destroy();
+            a = std::exchange(b.a, nullptr);
+            v = std::move(b.v);
+            ts = std::move(b.ts);
+            i_offset = b.i_offset;
+            q_offset = b.q_offset;
+            ts_offset = b.ts_offset;
+        }
+        return *this;
     }
 
     void destroy() {
         v.clear();
-        iio_buffer_destroy(a);
+        ts.clear();
+        if (a != nullptr) {
+            iio_buffer_destroy(a);
+            a = nullptr;
+        }
     }
 
     void set_blocking_mode(bool x) {
@@ -151,14 +765,30 @@ public:
         return v.end();
     }
 
+    // True when a timestamp channel is enabled
+    bool timestamped() const {
+        return ts_offset >= 0;
+    }
+
+    // Timestamp of every sample of the last refill, empty without a timestamp channel
+    std::vector<int64_t> const& timestamps() const {
+        return ts;
+    }
+
+    /*
+     * Swaps the converted samples and timestamps with vectors of the same
+     * sizes, which keeps a refilled block without copying it.
+     */
+    void exchange(std::vector<std::complex<int16_t>>& samples, std::vector<int64_t>& stamps) {
+        if (samples.size() != v.size() || stamps.size() != ts.size()) {
+            throw std::system_error{EINVAL, std::generic_category(), "buffer exchange size mismatch"};
+        }
+        v.swap(samples);
+        ts.swap(stamps);
+    }
+
     ssize_t push(size_t samples_count = 0) {
-        int i = 0;
-        for (auto t_dat = (char *)iio_buffer_start(a); t_dat < iio_buffer_end(a); t_dat += iio_buffer_step(a)) {
-			((int16_t*)t_dat)[0] = v[i].imag();
-			((int16_t*)t_dat)[1] = v[i].real();
-			i++;
-		}
-        int err = 0;
+        convert_out();
         if (samples_count == 0) {
             return iio_buffer_push(a);
         } else {
@@ -166,13 +796,37 @@ public:
         }
     }
 
+    /*
+     * Touches every page of the sample memory, both the libiio buffer and
+     * the converted copy, so the first refill does not page-fault, and
+     * locks both when lock is set. Returns 0 or the mlock errno.
+     */
+    int prefault(bool lock = false) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        char* start = (char*)iio_buffer_start(a);
+        char* end = (char*)iio_buffer_end(a);
+        for (volatile char* p = start; p < end; p += page) {
+            (void)*p;
+        }
+        for (size_t i = 0; i < v.size(); i += page / sizeof(v[0])) {
+            ((volatile int16_t*)&v[i])[0] = 0;
+        }
+        for (size_t i = 0; i < ts.size(); i += page / sizeof(ts[0])) {
+            ((volatile int64_t*)&ts[i])[0] = 0;
+        }
+        if (!lock) {
+            return 0;
+        }
+        if (mlock(start, end - start) < 0 || mlock(v.data(), v.size() * sizeof(v[0])) < 0
+                || (!ts.empty() && mlock(ts.data(), ts.size() * sizeof(ts[0])) < 0)) {
+            return errno;
+        }
+        return 0;
+    }
+
     ssize_t refill() {
         auto ret = iio_buffer_refill(a);
-        int i = 0;
-        for (auto t_dat = (char *)iio_buffer_start(a); t_dat < iio_buffer_end(a); t_dat += iio_buffer_step(a)) {
-			v[i] = std::complex<int16_t>(((int16_t*)t_dat)[1], ((int16_t*)t_dat)[0]);
-			i++;
-		}
+        convert_in();
         return ret;
     }
 };
@@ -185,49 +839,105 @@ public:
     }
     int size();
     Device operator[] (unsigned int i);
-    Device operator[] (std::string s);
+    Device operator[] (std::string_view s);
 };
 
 class Context {
     iio_context* a;
+    std::chrono::duration<double> created_in;
+    Context_Index index;
+
+    void check() {
+        if (a == nullptr) {
+            throw std::system_error{errno, std::generic_category(), "context not created"};
+        }
+        index.build(a);
+    }
 public:
     Context_Devices devices;
     friend Context_Devices;
     friend Device;
-    Context(iio_context* con): devices(this) {
+    friend Context_Cache;
+    friend Profile_Applier;
+    Context(iio_context* con): created_in(0), devices(this) {
         a = con;
+        if (a != nullptr) {
+            index.build(a);
+        }
     }
 
     Context(): devices(this) {
+        auto start = std::chrono::steady_clock::now();
         a = iio_create_default_context();
+        created_in = std::chrono::steady_clock::now() - start;
+        check();
     }
 
     Context(std::string type, std::string s = ""): devices(this) {
+        auto start = std::chrono::steady_clock::now();
         if (type == "uri") {
             a = iio_create_context_from_uri(s.c_str());
         } else if (type == "local") {
             a = iio_create_local_context();
         } else if (type == "network") {
             a = iio_create_network_context(s.c_str());
+        } else if (type == "xml") {
+            a = iio_create_xml_context(s.c_str());
         } else {
             assert(0);
         }
+        created_in = std::chrono::steady_clock::now() - start;
+        check();
     }
 
-    Context(const Context& c): devices(this) {
-        a = iio_context_clone(c.a);
+    /*
+     * Move-only: copying would reconnect and parse the XML again, use
+     * clone() for that. Moves keep the index, whose entries live on the
+     * heap, and rebind devices to the new owner.
+     */
+    Context(const Context&) = delete;
+    Context& operator =(const Context&) = delete;
+
+    Context(Context&& c) noexcept
+        : a(std::exchange(c.a, nullptr)), created_in(c.created_in), index(std::move(c.index)), devices(this) {
+    }
+
+    Context& operator =(Context&& c) noexcept {
+        if (this != &c) {
+            destroy();
+            a = std::exchange(c.a, nullptr);
+            created_in = c.created_in;
+            index = std::move(c.index);
+        }
+        return *this;
+    }
+
+    // New connection with the same description, via iio_context_clone
+    Context clone() const {
+        auto start = std::chrono::steady_clock::now();
+        iio_context* b = iio_context_clone(a);
+        if (b == nullptr) {
+            throw std::system_error{errno, std::generic_category(), "context not cloned"};
+        }
+        Context c(b);
+        c.created_in = std::chrono::steady_clock::now() - start;
+        return c;
     }
 
     void destroy() {
-        iio_context_destroy(a);
+        if (a != nullptr) {
+            iio_context_destroy(a);
+            a = nullptr;
+        }
+        index = Context_Index{};
     }
 
     ~Context() {
         this->destroy();
     }
 
-    Device find_device(std::string s) {
-        return Device(iio_context_find_device(a, s.c_str()));
+    Device find_device(std::string_view s) {
+        return devices[s];
     }
 
     unsigned int devices_count() {
@@ -236,13 +946,94 @@ public:
     std::string name() {
         return std::string(iio_context_get_name(a));
     }
+
+    // Context attribute such as "fw_version", empty if the context has none
+    std::string attribute(std::string const& key) {
+        const char* v = iio_context_get_attr_value(a, key.c_str());
+        return v ? std::string(v) : std::string();
+    }
+
+    std::string xml() {
+        return std::string(iio_context_get_xml(a));
+    }
+
+    /*
+     * Deadline for every blocking operation of this context, attribute I/O
+     * and refill/push alike; zero waits forever.
+     */
+    void set_timeout(std::chrono::milliseconds timeout) {
+        int err = iio_context_set_timeout(a, (unsigned int)timeout.count());
+        if (err < 0) {
+            throw std::system_error{-err, std::generic_category(), "context timeout not set"};
+        }
+    }
+
+    // Seconds spent creating (or cloning) the underlying iio_context
+    double creation_latency() const {
+        return created_in.count();
+    }
+};
+
+/*
+ * On-disk snapshots of context XML keyed by URI and firmware version.
+ * Snapshots are loaded with iio_create_xml_context for describing devices
+ * offline; a live context is checked against its snapshot by a plain byte
+ * comparison, without parsing the cached XML again. A loaded snapshot is
+ * an offline context that cannot read attributes or stream, and it does
+ * not shorten network startup: libiio 0.x downloads and parses the XML
+ * whenever a network context is created, and validate() needs one.
+ */
+class Context_Cache {
+    std::filesystem::path dir;
+
+    static std::string sanitize(std::string const& s) {
+        std::string r = s;
+        for (auto& c : r) {
+            if (!isalnum((unsigned char)c) && c != '.' && c != '-') {
+                c = '_';
+            }
+        }
+        return r;
+    }
+
+    static bool read_file(std::filesystem::path const& p, std::string* out) {
+        std::ifstream f(p, std::ios::binary);
+        if (!f) {
+            return false;
+        }
+        std::ostringstream ss;
+        ss << f.rdbuf();
+        *out = ss.str();
+        return true;
+    }
+public:
+    Context_Cache(std::string directory) : dir(directory) {
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+    }
+
+    std::string path(std::string const& uri, std::string const& fw_version) {
+        return (dir / (sanitize(uri) + "@" + sanitize(fw_version) + ".xml")).string();
+    }
+
+    // Most recently stored snapshot for uri, any firmware version; empty if none
+    std::string find(std::string const& uri);
+
+    bool contains(std::string const& uri, std::string const& fw_version) {
+        return std::filesystem::exists(path(uri, fw_version));
+    }
+
+    void store(Context& ctx, std::string const& uri);
+    bool validate(Context& ctx, std::string const& uri);
+    Context load(std::string const& uri, std::string const& fw_version);
+    Context load(std::string const& uri);
 };
 
 class Channel_Attribute {
-    Channel *dev;
+    iio_channel *dev;
 public:
-    std::string key;
-    Channel_Attribute (std::string str, Channel *device) {
+    const char* key;
+    Channel_Attribute (const char* str, iio_channel *device) {
         key = str;
         dev = device;
     }
@@ -252,27 +1043,42 @@ public:
     Channel_Attribute& operator =(double str);
     Channel_Attribute& operator =(bool str);
     std::string value();
+    // Reads into dst without allocating, the view is valid while dst is
+    std::string_view read(char* dst, size_t len);
+    // Typed read: long long, double or bool, parsed by libiio
+    template <typename T>
+    T as();
 };
 
 class Channel_Attributes {
-    Channel* a;
+    iio_channel* a;
 public:
-    Channel_Attributes(Channel* b) {
+    Channel_Attributes(iio_channel* b) {
         a = b;
     }
     int size();
     std::string operator[] (unsigned int i);
-    Channel_Attribute operator[] (std::string s);
+    Channel_Attribute operator[] (std::string_view s);
+    template <typename T>
+    Typed_Channel_Attribute<T> operator[] (Attr<T> attr);
+    // Serve reads from values at most max_age old, zero disables the cache
+    void set_cache(std::chrono::steady_clock::duration max_age);
+    // Re-read all attributes in one round-trip
+    void refresh();
+    void invalidate();
 };
 
 class Channel {
     iio_channel *a;
 public:
-    friend Channel_Attributes;
-    friend Channel_Attribute;
+    friend Config_Transaction;
+    friend Fastlock_Hopper;
+    friend Sweep_Engine;
+    friend Stream_Layout;
+    friend Context_Executor;
     Channel_Attributes attributes;
 
-    Channel (iio_channel *b) : a(b), attributes(this) {
+    Channel (iio_channel *b) : a(b), attributes(b) {
     }
 
     std::string name() {
@@ -290,145 +1096,1186 @@ public:
     void disable() {
         iio_channel_disable(a);
     }
-};
 
-std::string Device::id() {
-    return std::string(iio_device_get_id(dev));
-}
+    bool enabled() const {
+        return iio_channel_is_enabled(a);
+    }
 
-std::string Device::name() {
-    return std::string(iio_device_get_name(dev));
-}
+    // Scan index, type, modifier and data format, cached in the Context index
+    Channel_Info info() const {
+        if (auto idx = (Channel_Index*)iio_channel_get_data(a)) {
+            return idx->info;
+        }
+        return describe_channel(a);
+    }
+};
 
-int Context_Devices::size() {
-    return iio_context_get_devices_count(a->a);
-}
+static_assert(std::is_trivially_copyable_v<Device> && std::is_trivially_copyable_v<Channel>);
+static_assert(std::is_trivially_copyable_v<Device_Attribute> && std::is_trivially_copyable_v<Channel_Attribute>);
 
-Device Context_Devices::operator[] (unsigned int i) {
-    return Device(iio_context_get_device(a->a, i));
-}
+struct Stream_Field {
+    Channel channel;
+    Channel_Info info;
+    size_t offset;              // bytes from the start of a sample
+    size_t length;              // bytes, format.length / 8 * repeat
+};
 
-Device Context_Devices::operator[] (std::string s) {
-    return Device(iio_context_find_device(a->a, s.c_str()));
-}
+/*
+ * Sample layout of a device buffer planned before the buffer is created.
+ * plan() enables the named channels and disables every other scan element,
+ * so unused channels are never streamed, then computes byte offsets the
+ * way libiio packs samples: scan index order, each field aligned to its
+ * own length.
+ */
+class Stream_Layout {
+public:
+    std::vector<Stream_Field> fields;   // scan index order
+    size_t sample_size;
 
-std::string Channel_Attributes::operator[] (unsigned int i) {
-    return std::string(iio_channel_get_attr(a->a, i));
-}
+    static Stream_Layout plan(Device dev, std::vector<std::string_view> const& channels, bool output = false);
 
-Channel_Attribute Channel_Attributes::operator[] (std::string s) {
-    return Channel_Attribute(s, a);
-}
+    // Field by channel id or name
+    Stream_Field const& operator[] (std::string_view s) const;
 
-std::string Device_Attributes::operator[] (unsigned int i) {
-    return std::string(iio_device_get_attr(a->dev, i));
-}
+    size_t size() const {
+        return fields.size();
+    }
 
-Device_Attribute Device_Attributes::operator[] (std::string s) {
-    return Device_Attribute(s, a);
-}
+    // Pointer to the field of sample i in a buffer starting at start
+    template <typename T>
+    T* at(void* start, size_t i, Stream_Field const& f) const {
+        return (T*)((char*)start + i * sample_size + f.offset);
+    }
+};
 
-Channel Device::find_channel(std::string s, bool output) {
-    return Channel(iio_device_find_channel(dev, s.c_str(), output));
-}
+struct Config_Result {
+    std::string target;     // "device" or "device/in|out/channel"
+    const char* key;
+    int err;                // 0, or a negative errno code
 
-Device_Attribute& Device_Attribute::operator =(std::string const& str) {
-    int err;
-    if((err = iio_device_attr_write(dev->dev, key.c_str(), str.c_str())) < 0) {
-        throw std::system_error{-err, std::generic_category(), "device attribute write error"};
+    bool ok() const {
+        return err == 0;
     }
-    return *this;
-}
+};
 
-Device_Attribute& Device_Attribute::operator =(const char* str) {
-    int err;
-    if((err = iio_device_attr_write(dev->dev, key.c_str(), str)) < 0) {
-        throw std::system_error{-err, std::generic_category(), "device attribute write error"};
-    }
-    return *this;
-}
+/*
+ * Attribute writes staged on devices and channels, then committed with one
+ * iio_*_attr_write_all round-trip per object. Writes with a lower rank are
+ * committed first, so attributes the driver needs in order (rf_bandwidth
+ * before sampling_frequency) go in separate passes. If a batch fails its
+ * writes are retried one by one so every attribute gets its own result.
+ */
+class Config_Transaction {
+    struct Write {
+        iio_device* dev;
+        iio_channel* chn;
+        const char* key;
+        std::string value;
+        int rank;
+        int err;
+    };
+    std::vector<Write> writes;
 
-Device_Attribute& Device_Attribute::operator = (long long str){
-    int err;
-    if((err = iio_device_attr_write_longlong(dev->dev, key.c_str(), str)) < 0) {
-        throw std::system_error{-err, std::generic_category(), "device attribute write error"};
+    static std::string format(long long val) {
+        return std::to_string(val);
     }
-    return *this;
+    static std::string format(double val) {
+        char tmp[64];
+        locale_t old = uselocale(c_locale());
+        snprintf(tmp, sizeof(tmp), "%lf", val);
+        uselocale(old);
+        return tmp;
+    }
+    static std::string format(bool val) {
+        return val ? "1" : "0";
+    }
+    static std::string format(const char* val) {
+        return val;
+    }
+
+    static ssize_t fill(const char* attr, void* buf, size_t len, void* d);
+    // Index of the write, which is also its index in the results of commit()
+    size_t stage(iio_device* dev, iio_channel* chn, const char* key, std::string value, int rank);
+    void commit_group(std::vector<Write*>& group);
+public:
+    friend Profile_Applier;
+
+    // Commit order of an attribute, lower first
+    static int default_rank(std::string_view key) {
+        return key == "sampling_frequency" ? 1 : 0;
+    }
+
+    Config_Transaction& set(Device const& dev, std::string_view key, std::string value) {
+        stage(dev.dev, nullptr, find_device_attr(dev.dev, key), std::move(value), default_rank(key));
+        return *this;
+    }
+
+    Config_Transaction& set(Channel const& chn, std::string_view key, std::string value) {
+        stage(nullptr, chn.a, find_channel_attr(chn.a, key), std::move(value), default_rank(key));
+        return *this;
+    }
+
+    template <typename T>
+    Config_Transaction& set(Device const& dev, Attr<T> attr, typename Attr<T>::arg_type val) {
+        stage(dev.dev, nullptr, attr.key, format(val), default_rank(attr.key));
+        return *this;
+    }
+
+    template <typename T>
+    Config_Transaction& set(Channel const& chn, Attr<T> attr, typename Attr<T>::arg_type val) {
+        stage(nullptr, chn.a, attr.key, format(val), default_rank(attr.key));
+        return *this;
+    }
+
+    size_t size() const {
+        return writes.size();
+    }
+
+    void clear() {
+        writes.clear();
+    }
+
+    // Writes all staged attributes and clears the transaction
+    std::vector<Config_Result> commit();
+};
+
+std::string Device::id() {
+    return std::string(iio_device_get_id(dev));
+}
+
+std::string Device::name() {
+    return std::string(iio_device_get_name(dev));
+}
+
+void Context_Index::build(iio_context* ctx) {
+    unsigned int nb_devices = iio_context_get_devices_count(ctx);
+    size_t nb_channels = 0;
+    for (unsigned int i = 0; i < nb_devices; i++) {
+        nb_channels += iio_device_get_channels_count(iio_context_get_device(ctx, i));
+    }
+    // Entries are handed out by address, so storage must never reallocate
+    devices.clear();
+    channels.clear();
+    names.clear();
+    devices.reserve(nb_devices);
+    channels.reserve(nb_channels);
+
+    for (unsigned int i = 0; i < nb_devices; i++) {
+        iio_device* dev = iio_context_get_device(ctx, i);
+        devices.push_back(Device_Index{dev, {}, {}, {}, {}, {}, {}});
+        Device_Index& d = devices.back();
+
+        names.emplace(iio_device_get_id(dev), dev);
+        if (const char* name = iio_device_get_name(dev)) {
+            names.emplace(name, dev);
+        }
+        for (unsigned int j = 0; j < iio_device_get_attrs_count(dev); j++) {
+            const char* attr = iio_device_get_attr(dev, j);
+            d.attrs.emplace(attr, attr);
+        }
+
+        for (unsigned int j = 0; j < iio_device_get_channels_count(dev); j++) {
+            iio_channel* chn = iio_device_get_channel(dev, j);
+            channels.push_back(Channel_Index{chn, {}, {}, describe_channel(chn)});
+            Channel_Index& c = channels.back();
+            for (unsigned int k = 0; k < iio_channel_get_attrs_count(chn); k++) {
+                const char* attr = iio_channel_get_attr(chn, k);
+                c.attrs.emplace(attr, attr);
+            }
+            iio_channel_set_data(chn, &c);
+
+            bool output = iio_channel_is_output(chn);
+            auto& chn_names = output ? d.out_names : d.in_names;
+            (output ? d.out : d.in).push_back(chn);
+            chn_names.emplace(iio_channel_get_id(chn), chn);
+            if (const char* name = iio_channel_get_name(chn)) {
+                chn_names.emplace(name, chn);
+            }
+        }
+        iio_device_set_data(dev, &d);
+    }
+}
+
+int Context_Devices::size() {
+    return iio_context_get_devices_count(a->a);
+}
+
+Device Context_Devices::operator[] (unsigned int i) {
+    return Device(iio_context_get_device(a->a, i));
+}
+
+Device Context_Devices::operator[] (std::string_view s) {
+    auto it = a->index.names.find(s);
+    if (it == a->index.names.end()) {
+        throw std::system_error{ENODEV, std::generic_category(), "device not found"};
+    }
+    return Device(it->second);
+}
+
+void Channel_Attributes::set_cache(std::chrono::steady_clock::duration max_age) {
+    auto cache = channel_attr_cache(a);
+    if (cache == nullptr) {
+        throw std::system_error{ENOTSUP, std::generic_category(), "attribute cache needs a Context"};
+    }
+    cache->max_age = max_age;
+    cache->valid = false;
+}
+
+void Channel_Attributes::refresh() {
+    auto cache = channel_attr_cache(a);
+    if (cache == nullptr) {
+        throw std::system_error{ENOTSUP, std::generic_category(), "attribute cache needs a Context"};
+    }
+    refresh_channel_attrs(a, cache);
+}
+
+void Channel_Attributes::invalidate() {
+    invalidate_channel_attrs(a);
+}
+
+int Channel_Attributes::size() {
+    return iio_channel_get_attrs_count(a);
+}
+
+std::string Channel_Attributes::operator[] (unsigned int i) {
+    return std::string(iio_channel_get_attr(a, i));
+}
+
+Channel_Attribute Channel_Attributes::operator[] (std::string_view s) {
+    return Channel_Attribute(find_channel_attr(a, s), a);
+}
+
+template <typename T>
+Typed_Channel_Attribute<T> Channel_Attributes::operator[] (Attr<T> attr) {
+    return Typed_Channel_Attribute<T>(a, attr.key);
+}
+
+template <typename T>
+Typed_Device_Attribute<T> Device_Attributes::operator[] (Attr<T> attr) {
+    return Typed_Device_Attribute<T>(a, attr.key);
+}
+
+void Device_Attributes::set_cache(std::chrono::steady_clock::duration max_age) {
+    auto cache = device_attr_cache(a);
+    if (cache == nullptr) {
+        throw std::system_error{ENOTSUP, std::generic_category(), "attribute cache needs a Context"};
+    }
+    cache->max_age = max_age;
+    cache->valid = false;
+}
+
+void Device_Attributes::refresh() {
+    auto cache = device_attr_cache(a);
+    if (cache == nullptr) {
+        throw std::system_error{ENOTSUP, std::generic_category(), "attribute cache needs a Context"};
+    }
+    refresh_device_attrs(a, cache);
+}
+
+void Device_Attributes::invalidate() {
+    invalidate_device_attrs(a);
+}
+
+int Device_Attributes::size() {
+    return iio_device_get_attrs_count(a);
+}
+
+std::string Device_Attributes::operator[] (unsigned int i) {
+    return std::string(iio_device_get_attr(a, i));
+}
+
+Device_Attribute Device_Attributes::operator[] (std::string_view s) {
+    return Device_Attribute(find_device_attr(a, s), a);
+}
+
+Channel Device::find_channel(std::string_view s, bool output) {
+    return output ? out[s] : in[s];
+}
+
+std::optional<Device> Device::trigger() const {
+    const iio_device* trig = nullptr;
+    int err = iio_device_get_trigger(dev, &trig);
+    if (err == -ENOENT || (err == 0 && trig == nullptr)) {
+        return std::nullopt;
+    }
+    if (err < 0) {
+        throw std::system_error{-err, std::generic_category(), "trigger read error"};
+    }
+    return Device(const_cast<iio_device*>(trig));
+}
+
+void Device::set_trigger(Device const& trigger) {
+    int err = iio_device_set_trigger(dev, trigger.dev);
+    if (err < 0) {
+        throw std::system_error{-err, std::generic_category(), "trigger not set"};
+    }
+}
+
+void Device::clear_trigger() {
+    int err = iio_device_set_trigger(dev, nullptr);
+    if (err < 0) {
+        throw std::system_error{-err, std::generic_category(), "trigger not cleared"};
+    }
+}
+
+void Buffer::locate(iio_device* dev) {
+    const char* start = (const char*)iio_buffer_start(a);
+    std::vector<ptrdiff_t> data;
+    for (unsigned int i = 0; i < iio_device_get_channels_count(dev); i++) {
+        iio_channel* chn = iio_device_get_channel(dev, i);
+        if (!iio_channel_is_enabled(chn) || !iio_channel_is_scan_element(chn)) {
+            continue;
+        }
+        ptrdiff_t offset = (const char*)iio_buffer_first(a, chn) - start;
+        unsigned int length = iio_channel_get_data_format(chn)->length;
+        if (iio_channel_get_type(chn) == IIO_TIMESTAMP && length == 64) {
+            ts_offset = offset;
+        } else if (length == 16) {
+            data.push_back(offset);
+        }
+    }
+    if (data.size() < 2) {
+        throw std::system_error{EINVAL, std::generic_category(), "buffer has no 16-bit I and Q channels"};
+    }
+    std::sort(data.begin(), data.end());
+    i_offset = data[0];
+    q_offset = data[1];
+}
+
+Device_Attribute& Device_Attribute::operator =(std::string const& str) {
+    int err = iio_device_attr_write(dev, key, str.c_str());
+    invalidate_device_attrs(dev);
+    if (err < 0) {
+        throw std::system_error{-err, std::generic_category(), "device attribute write error"};
+    }
+    return *this;
+}
+
+Device_Attribute& Device_Attribute::operator =(const char* str) {
+    int err = iio_device_attr_write(dev, key, str);
+    invalidate_device_attrs(dev);
+    if (err < 0) {
+        throw std::system_error{-err, std::generic_category(), "device attribute write error"};
+    }
+    return *this;
+}
+
+Device_Attribute& Device_Attribute::operator = (long long str){
+    int err = iio_device_attr_write_longlong(dev, key, str);
+    invalidate_device_attrs(dev);
+    if (err < 0) {
+        throw std::system_error{-err, std::generic_category(), "device attribute write error"};
+    }
+    return *this;
 }
 
 Device_Attribute& Device_Attribute::operator = (bool str){
-    int err;
-    if ((err = iio_device_attr_write_bool(dev->dev, key.c_str(), str)) < 0) {
+    int err = iio_device_attr_write_bool(dev, key, str);
+    invalidate_device_attrs(dev);
+    if (err < 0) {
         throw std::system_error{-err, std::generic_category(), "device attribute write error"};
     }
     return *this;
 }
 
 Device_Attribute& Device_Attribute::operator = (double str){
-    int err;
-    if ((err = iio_device_attr_write_double(dev->dev, key.c_str(), str)) < 0) {
+    int err = iio_device_attr_write_double(dev, key, str);
+    invalidate_device_attrs(dev);
+    if (err < 0) {
         throw std::system_error{-err, std::generic_category(), "device attribute write error"};
     }
     return *this;
 }
 
 std::string Device_Attribute::value() {
-    char tmp[MAXATRLENGTH];
-    iio_device_attr_read(dev->dev, key.c_str(), tmp, MAXATRLENGTH);
-    return std::string(tmp);
+    return Typed_Device_Attribute<std::string>(dev, key).value();
+}
+
+std::string_view Device_Attribute::read(char* dst, size_t len) {
+    if (auto cached = cached_device_attr(dev, key)) {
+        if (cached->size() >= len) {
+            throw std::system_error{EMSGSIZE, std::generic_category(), "device attribute read error"};
+        }
+        memcpy(dst, cached->c_str(), cached->size() + 1);
+        return std::string_view(dst, cached->size());
+    }
+    return read_attribute([this](char* buf, size_t n) {
+        return iio_device_attr_read(dev, key, buf, n);
+    }, dst, len, fills_attr_buffer(dev), "device attribute read error");
+}
+
+template <typename T>
+T Device_Attribute::as() {
+    return Typed_Device_Attribute<T>(dev, key).value();
 }
 
 Channel_Attribute& Channel_Attribute::operator =(std::string const& str) {
-    int err;
-    if ((err = iio_channel_attr_write(dev->a, key.c_str(), str.c_str())) < 0) {
+    int err = iio_channel_attr_write(dev, key, str.c_str());
+    invalidate_channel_attrs(dev);
+    if (err < 0) {
         throw std::system_error{-err, std::generic_category(), "channel attribute write error"};
     }
     return *this;
 }
 
 Channel_Attribute& Channel_Attribute::operator =(const char* str) {
-    int err;
-    if ((err = iio_channel_attr_write(dev->a, key.c_str(), str)) < 0) {
+    int err = iio_channel_attr_write(dev, key, str);
+    invalidate_channel_attrs(dev);
+    if (err < 0) {
         throw std::system_error{-err, std::generic_category(), "channel attribute write error"};
     }
     return *this;
 }
 
 Channel_Attribute& Channel_Attribute::operator = (long long str){
-    int err;
-    if ((err = iio_channel_attr_write_longlong(dev->a, key.c_str(), str)) < 0) {
+    int err = iio_channel_attr_write_longlong(dev, key, str);
+    invalidate_channel_attrs(dev);
+    if (err < 0) {
         throw std::system_error{-err, std::generic_category(), "channel attribute write error"};
     }
     return *this;
 }
 
 Channel_Attribute& Channel_Attribute::operator = (bool str){
-    int err;
-    if ((err = iio_channel_attr_write_bool(dev->a, key.c_str(), str)) < 0) {
+    int err = iio_channel_attr_write_bool(dev, key, str);
+    invalidate_channel_attrs(dev);
+    if (err < 0) {
         throw std::system_error{-err, std::generic_category(), "channel attribute write error"};
     }
     return *this;
 }
 
 Channel_Attribute& Channel_Attribute::operator = (double str){
-    int err;
-    if((err = iio_channel_attr_write_double(dev->a, key.c_str(), str)) < 0) {
+    int err = iio_channel_attr_write_double(dev, key, str);
+    invalidate_channel_attrs(dev);
+    if (err < 0) {
         throw std::system_error{-err, std::generic_category(), "channel attribute write error"};
     }
     return *this;
 }
 
 std::string Channel_Attribute::value() {
-    char tmp[MAXATRLENGTH];
-    iio_channel_attr_read(dev->a, key.c_str(), tmp, MAXATRLENGTH);
-    return std::string(tmp);
+    return Typed_Channel_Attribute<std::string>(dev, key).value();
+}
+
+std::string_view Channel_Attribute::read(char* dst, size_t len) {
+    if (auto cached = cached_channel_attr(dev, key)) {
+        if (cached->size() >= len) {
+            throw std::system_error{EMSGSIZE, std::generic_category(), "channel attribute read error"};
+        }
+        memcpy(dst, cached->c_str(), cached->size() + 1);
+        return std::string_view(dst, cached->size());
+    }
+    return read_attribute([this](char* buf, size_t n) {
+        return iio_channel_attr_read(dev, key, buf, n);
+    }, dst, len, fills_attr_buffer(dev), "channel attribute read error");
+}
+
+template <typename T>
+T Channel_Attribute::as() {
+    return Typed_Channel_Attribute<T>(dev, key).value();
+}
+
+int Device_Channels::size() const {
+    if (auto idx = (Device_Index*)iio_device_get_data(a)) {
+        return (out ? idx->out : idx->in).size();
+    }
+    int n = 0;
+    for (unsigned int i = 0; i < iio_device_get_channels_count(a); i++) {
+        n += iio_channel_is_output(iio_device_get_channel(a, i)) == out;
+    }
+    return n;
+}
+
+Channel Device_Channels::operator[] (unsigned int i) const {
+    if (auto idx = (Device_Index*)iio_device_get_data(a)) {
+        auto& list = out ? idx->out : idx->in;
+        if (i >= list.size()) {
+            throw std::system_error{ENOENT, std::generic_category(), "channel not found"};
+        }
+        return Channel{list[i]};
+    }
+    for (unsigned int j = 0; j < iio_device_get_channels_count(a); j++) {
+        iio_channel* chn = iio_device_get_channel(a, j);
+        if (iio_channel_is_output(chn) == out && i-- == 0) {
+            return Channel{chn};
+        }
+    }
+    throw std::system_error{ENOENT, std::generic_category(), "channel not found"};
 }
 
-Channel Device_Channels::operator[] (std::string s) {
-    auto ret{iio_device_find_channel(a->dev, s.c_str(), out)};
+Channel Device_Channels::operator[] (std::string_view s) const {
+    if (auto idx = (Device_Index*)iio_device_get_data(a)) {
+        auto& names = out ? idx->out_names : idx->in_names;
+        auto it = names.find(s);
+        if (it == names.end()) {
+            throw std::system_error{ENOENT, std::generic_category(), "channel not found"};
+        }
+        return Channel{it->second};
+    }
+    auto ret{iio_device_find_channel(a, std::string(s).c_str(), out)};
     if (ret == nullptr) {
         int err = errno;
         throw std::system_error{err, std::generic_category(), "channel not found"};
     }
     return Channel{ret};
 }
+
+Channel Device_Channels::iterator::operator*() const {
+    return (*chs)[i];
+}
+
+Stream_Layout Stream_Layout::plan(Device dev, std::vector<std::string_view> const& channels, bool output) {
+    Device_Channels& list = output ? dev.out : dev.in;
+    std::vector<iio_channel*> wanted;
+    for (auto s : channels) {
+        wanted.push_back(list[s].a);
+    }
+    for (Channel c : list) {
+        if (!iio_channel_is_scan_element(c.a)) {
+            continue;
+        }
+        if (std::find(wanted.begin(), wanted.end(), c.a) != wanted.end()) {
+            c.enable();
+        } else {
+            c.disable();
+        }
+    }
+
+    Stream_Layout layout{{}, 0};
+    for (Channel c : list) {
+        Channel_Info info = c.info();
+        if (info.scan_element && c.enabled()) {
+            layout.fields.push_back(Stream_Field{c, info, 0, info.format.length / 8 * std::max(info.format.repeat, 1u)});
+        }
+    }
+    std::stable_sort(layout.fields.begin(), layout.fields.end(), [](Stream_Field const& x, Stream_Field const& y) {
+        return x.info.index < y.info.index;
+    });
+    for (auto& f : layout.fields) {
+        layout.sample_size = (layout.sample_size + f.length - 1) / f.length * f.length;
+        f.offset = layout.sample_size;
+        layout.sample_size += f.length;
+    }
+
+    ssize_t expected = iio_device_get_sample_size(dev.dev);
+    if (expected >= 0 && (size_t)expected != layout.sample_size) {
+        throw std::system_error{EPROTO, std::generic_category(), "stream layout does not match libiio sample size"};
+    }
+    return layout;
+}
+
+Stream_Field const& Stream_Layout::operator[] (std::string_view s) const {
+    for (auto& f : fields) {
+        if (s == f.info.id || (f.info.name && s == f.info.name)) {
+            return f;
+        }
+    }
+    throw std::system_error{ENOENT, std::generic_category(), "channel not in stream layout"};
+}
+
+std::string Context_Cache::find(std::string const& uri) {
+    std::string prefix = sanitize(uri) + "@";
+    std::filesystem::path best;
+    std::filesystem::file_time_type best_time;
+    std::error_code ec;
+    for (auto& e : std::filesystem::directory_iterator(dir, ec)) {
+        auto name = e.path().filename().string();
+        if (name.compare(0, prefix.size(), prefix) != 0 || e.path().extension() != ".xml") {
+            continue;
+        }
+        auto t = e.last_write_time(ec);
+        if (best.empty() || t > best_time) {
+            best = e.path();
+            best_time = t;
+        }
+    }
+    return best.string();
+}
+
+void Context_Cache::store(Context& ctx, std::string const& uri) {
+    auto p = path(uri, ctx.attribute("fw_version"));
+    auto tmp = p + ".tmp";
+    const char* xml = iio_context_get_xml(ctx.a);
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        f.write(xml, strlen(xml));
+        if (!f) {
+            throw std::system_error{EIO, std::generic_category(), "context snapshot not written"};
+        }
+    }
+    std::filesystem::rename(tmp, p);
+}
+
+bool Context_Cache::validate(Context& ctx, std::string const& uri) {
+    std::string cached;
+    if (!read_file(path(uri, ctx.attribute("fw_version")), &cached)) {
+        return false;
+    }
+    const char* xml = iio_context_get_xml(ctx.a);
+    return cached.size() == strlen(xml) && cached.compare(xml) == 0;
+}
+
+Context Context_Cache::load(std::string const& uri, std::string const& fw_version) {
+    return Context("xml", path(uri, fw_version));
+}
+
+Context Context_Cache::load(std::string const& uri) {
+    auto p = find(uri);
+    if (p.empty()) {
+        throw std::system_error{ENOENT, std::generic_category(), "no context snapshot"};
+    }
+    return Context("xml", p);
+}
+
+size_t Config_Transaction::stage(iio_device* dev, iio_channel* chn, const char* key, std::string value, int rank) {
+    // A later write to the same attribute replaces the earlier one
+    for (size_t i = 0; i < writes.size(); i++) {
+        Write& w = writes[i];
+        if (w.dev == dev && w.chn == chn && strcmp(w.key, key) == 0) {
+            w.value = std::move(value);
+            return i;
+        }
+    }
+    writes.push_back(Write{dev, chn, key, std::move(value), rank, -ENOENT});
+    return writes.size() - 1;
+}
+
+ssize_t Config_Transaction::fill(const char* attr, void* buf, size_t len, void* d) {
+    for (auto w : *(std::vector<Write*>*)d) {
+        if (strcmp(w->key, attr) != 0) {
+            continue;
+        }
+        if (w->value.size() + 1 > len) {
+            return -ENOMEM;
+        }
+        memcpy(buf, w->value.c_str(), w->value.size() + 1);
+        w->err = 0;
+        return w->value.size() + 1;
+    }
+    // Zero length leaves the attribute untouched
+    return 0;
+}
+
+void Config_Transaction::commit_group(std::vector<Write*>& group) {
+    iio_device* dev = group[0]->dev;
+    iio_channel* chn = group[0]->chn;
+    int err;
+    if (chn) {
+        err = iio_channel_attr_write_all(chn, [](iio_channel*, const char* attr, void* buf, size_t len, void* d) {
+            return fill(attr, buf, len, d);
+        }, &group);
+        invalidate_channel_attrs(chn);
+    } else {
+        err = iio_device_attr_write_all(dev, [](iio_device*, const char* attr, void* buf, size_t len, void* d) {
+            return fill(attr, buf, len, d);
+        }, &group);
+        invalidate_device_attrs(dev);
+    }
+    if (err >= 0) {
+        return;
+    }
+    for (auto w : group) {
+        ssize_t ret = chn ? iio_channel_attr_write(chn, w->key, w->value.c_str())
+                          : iio_device_attr_write(dev, w->key, w->value.c_str());
+        w->err = ret < 0 ? (int)ret : 0;
+    }
+}
+
+std::vector<Config_Result> Config_Transaction::commit() {
+    std::vector<Write*> order;
+    for (auto& w : writes) {
+        order.push_back(&w);
+    }
+    std::stable_sort(order.begin(), order.end(), [](Write* x, Write* y) { return x->rank < y->rank; });
+
+    std::vector<char> grouped(order.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        if (grouped[i]) {
+            continue;
+        }
+        std::vector<Write*> group;
+        for (size_t j = i; j < order.size() && order[j]->rank == order[i]->rank; j++) {
+            if (!grouped[j] && order[j]->dev == order[i]->dev && order[j]->chn == order[i]->chn) {
+                group.push_back(order[j]);
+                grouped[j] = 1;
+            }
+        }
+        commit_group(group);
+    }
+
+    std::vector<Config_Result> results;
+    for (auto& w : writes) {
+        const iio_device* dev = w.chn ? iio_channel_get_device(w.chn) : w.dev;
+        const char* name = iio_device_get_name(dev);
+        std::string target = name ? name : iio_device_get_id(dev);
+        if (w.chn) {
+            target += iio_channel_is_output(w.chn) ? "/out/" : "/in/";
+            target += iio_channel_get_id(w.chn);
+        }
+        results.push_back(Config_Result{std::move(target), w.key, w.err});
+    }
+    writes.clear();
+    return results;
+}
+
+/*
+ * Declarative radio configuration: attribute paths mapped to values.
+ * Paths are "device/attr" or "device/in|out/channel/attr". Profiles load
+ * from text, one "path = value" per line with '#' comments, or from a flat
+ * JSON object of path keys and string or number values.
+ */
+struct Profile_Setting {
+    std::string device;
+    std::string channel;    // empty for device attributes
+    bool output;
+    std::string attr;
+    std::string value;
+
+    std::string path() const {
+        if (channel.empty()) {
+            return device + "/" + attr;
+        }
+        return device + (output ? "/out/" : "/in/") + channel + "/" + attr;
+    }
+};
+
+class Radio_Profile {
+    static std::string trim(std::string const& s) {
+        size_t b = s.find_first_not_of(" \t\r\n");
+        size_t e = s.find_last_not_of(" \t\r\n");
+        return b == std::string::npos ? std::string() : s.substr(b, e - b + 1);
+    }
+    void parse_text(std::string const& text);
+    void parse_json(std::string const& text);
+public:
+    std::string name;
+    std::vector<Profile_Setting> settings;
+
+    Radio_Profile(std::string profile_name = "") : name(profile_name) {
+    }
+
+    // Adds or replaces the setting for path
+    Radio_Profile& set(std::string const& path, std::string value);
+
+    static Radio_Profile parse(std::string const& text, std::string profile_name = "");
+    static Radio_Profile load(std::string const& file);
+};
+
+struct Profile_Report {
+    size_t written;
+    size_t unchanged;
+    double latency;     // seconds spent in apply(), reads and writes included
+    std::vector<Config_Result> results;
+    std::vector<std::string> failed;    // settings whose write failed, paths as the profile spelled them
+};
+
+/*
+ * Applies profiles by diffing them against the last known device state and
+ * committing only the attributes that differ in one Config_Transaction.
+ * State unknown so far is read with one iio_*_attr_read_all per object.
+ */
+class Profile_Applier {
+    Context* ctx;
+    std::unordered_map<std::string, std::string> state;
+
+    static bool same_value(std::string const& want, std::string const& have);
+public:
+    Profile_Applier(Context& context) : ctx(&context) {
+    }
+
+    Profile_Report apply(Radio_Profile const& profile);
+
+    // Drops the last known state, e.g. when something else wrote the device
+    void forget() {
+        state.clear();
+    }
+};
+
+Radio_Profile& Radio_Profile::set(std::string const& path, std::string value) {
+    Profile_Setting s{};
+    size_t first = path.find('/');
+    size_t last = path.rfind('/');
+    if (first == std::string::npos || first == 0 || last == path.size() - 1) {
+        throw std::system_error{EINVAL, std::generic_category(), "bad profile path " + path};
+    }
+    s.device = path.substr(0, first);
+    s.attr = path.substr(last + 1);
+    if (first != last) {
+        size_t second = path.find('/', first + 1);
+        std::string dir = path.substr(first + 1, second - first - 1);
+        if ((dir != "in" && dir != "out") || second == last) {
+            throw std::system_error{EINVAL, std::generic_category(), "bad profile path " + path};
+        }
+        s.output = dir == "out";
+        s.channel = path.substr(second + 1, last - second - 1);
+    }
+    s.value = std::move(value);
+    for (auto& old : settings) {
+        if (old.path() == path) {
+            old = std::move(s);
+            return *this;
+        }
+    }
+    settings.push_back(std::move(s));
+    return *this;
+}
+
+void Radio_Profile::parse_text(std::string const& text) {
+    std::istringstream in(text);
+    std::string line;
+    while (std::getline(in, line)) {
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) {
+            continue;
+        }
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) {
+            throw std::system_error{EINVAL, std::generic_category(), "bad profile line " + line};
+        }
+        set(trim(line.substr(0, eq)), trim(line.substr(eq + 1)));
+    }
+}
+
+void Radio_Profile::parse_json(std::string const& text) {
+    size_t p = text.find('{') + 1;
+    auto skip = [&]() {
+        while (p < text.size() && isspace((unsigned char)text[p])) {
+            p++;
+        }
+    };
+    auto fail = [&]() {
+        throw std::system_error{EINVAL, std::generic_category(), "bad profile json at " + std::to_string(p)};
+    };
+    auto hex4 = [&]() {
+        if (p + 4 > text.size() || !std::all_of(text.begin() + p, text.begin() + p + 4, [](char c) {
+                return isxdigit((unsigned char)c);
+            })) {
+            fail();
+        }
+        unsigned v = (unsigned)strtoul(text.substr(p, 4).c_str(), nullptr, 16);
+        p += 4;
+        return v;
+    };
+    auto string = [&]() {
+        std::string r;
+        if (text[p++] != '"') {
+            fail();
+        }
+        while (p < text.size() && text[p] != '"') {
+            if (text[p] != '\\') {
+                r += text[p++];
+                continue;
+            }
+            if (++p >= text.size()) {
+                fail();
+            }
+            char c = text[p++];
+            switch (c) {
+            case '"': case '\\': case '/': r += c; break;
+            case 'b': r += '\b'; break;
+            case 'f': r += '\f'; break;
+            case 'n': r += '\n'; break;
+            case 'r': r += '\r'; break;
+            case 't': r += '\t'; break;
+            case 'u': {
+                unsigned cp = hex4();
+                // Characters outside the BMP come as a surrogate pair
+                if (cp >= 0xd800 && cp < 0xdc00) {
+                    if (text.compare(p, 2, "\\u") != 0) {
+                        fail();
+                    }
+                    p += 2;
+                    unsigned low = hex4();
+                    if (low < 0xdc00 || low >= 0xe000) {
+                        fail();
+                    }
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                } else if (cp >= 0xdc00 && cp < 0xe000) {
+                    fail();
+                }
+                // UTF-8
+                if (cp < 0x80) {
+                    r += (char)cp;
+                } else if (cp < 0x800) {
+                    r += (char)(0xc0 | cp >> 6);
+                    r += (char)(0x80 | (cp & 0x3f));
+                } else if (cp < 0x10000) {
+                    r += (char)(0xe0 | cp >> 12);
+                    r += (char)(0x80 | (cp >> 6 & 0x3f));
+                    r += (char)(0x80 | (cp & 0x3f));
+                } else {
+                    r += (char)(0xf0 | cp >> 18);
+                    r += (char)(0x80 | (cp >> 12 & 0x3f));
+                    r += (char)(0x80 | (cp >> 6 & 0x3f));
+                    r += (char)(0x80 | (cp & 0x3f));
+                }
+                break;
+            }
+            default:
+                fail();
+            }
+        }
+        if (p++ >= text.size()) {
+            fail();
+        }
+        return r;
+    };
+
+    skip();
+    while (p < text.size() && text[p] != '}') {
+        std::string path = string();
+        skip();
+        if (text[p++] != ':') {
+            fail();
+        }
+        skip();
+        std::string value;
+        if (text[p] == '"') {
+            value = string();
+        } else {
+            size_t end = text.find_first_of(",} \t\r\n", p);
+            if (end == std::string::npos) {
+                fail();
+            }
+            value = text.substr(p, end - p);
+            p = end;
+        }
+        set(path, value);
+        skip();
+        if (text[p] == ',') {
+            p++;
+            skip();
+        }
+    }
+}
+
+Radio_Profile Radio_Profile::parse(std::string const& text, std::string profile_name) {
+    Radio_Profile profile(profile_name);
+    if (trim(text).compare(0, 1, "{") == 0) {
+        profile.parse_json(text);
+    } else {
+        profile.parse_text(text);
+    }
+    return profile;
+}
+
+Radio_Profile Radio_Profile::load(std::string const& file) {
+    std::ifstream f(file);
+    if (!f) {
+        throw std::system_error{errno, std::generic_category(), "profile not opened " + file};
+    }
+    std::ostringstream ss;
+    ss << f.rdbuf();
+    return parse(ss.str(), std::filesystem::path(file).stem().string());
+}
+
+// Numbers compare by value ("10.5" matches "10.500000 dB"), anything else as text
+bool Profile_Applier::same_value(std::string const& want, std::string const& have) {
+    char* want_end;
+    char* have_end;
+    double w = parse_double(want.c_str(), &want_end);
+    double h = parse_double(have.c_str(), &have_end);
+    if (want_end != want.c_str() && *want_end == '\0' && have_end != have.c_str()) {
+        return w == h || std::abs(w - h) <= 1e-9 * std::max(std::abs(w), std::abs(h));
+    }
+    return want == have;
+}
+
+Profile_Report Profile_Applier::apply(Radio_Profile const& profile) {
+    auto start = std::chrono::steady_clock::now();
+    Profile_Report report{0, 0, 0, {}, {}};
+    Config_Transaction config;
+    // Write index of each staged setting; aliases of one attribute share a write
+    std::vector<std::pair<size_t, Profile_Setting const*>> staged;
+
+    // One read-all per object whose state is not known yet
+    std::unordered_map<void*, Attribute_Cache> fetched;
+    for (auto& s : profile.settings) {
+        auto dev = ctx->index.names.find(s.device);
+        if (dev == ctx->index.names.end()) {
+            throw std::system_error{ENODEV, std::generic_category(), "device not found " + s.device};
+        }
+        iio_channel* chn = nullptr;
+        if (!s.channel.empty()) {
+            auto idx = (Device_Index*)iio_device_get_data(dev->second);
+            auto& names = s.output ? idx->out_names : idx->in_names;
+            auto it = names.find(s.channel);
+            if (it == names.end()) {
+                throw std::system_error{ENOENT, std::generic_category(), "channel not found " + s.channel};
+            }
+            chn = it->second;
+        }
+
+        std::string path = s.path();
+        auto known = state.find(path);
+        if (known == state.end()) {
+            void* obj = chn ? (void*)chn : (void*)dev->second;
+            auto cached = fetched.find(obj);
+            if (cached == fetched.end()) {
+                cached = fetched.emplace(obj, Attribute_Cache{}).first;
+                if (chn) {
+                    refresh_channel_attrs(chn, &cached->second);
+                } else {
+                    refresh_device_attrs(dev->second, &cached->second);
+                }
+            }
+            auto v = cached->second.values.find(s.attr);
+            if (v != cached->second.values.end()) {
+                known = state.emplace(path, v->second).first;
+            }
+        }
+        if (known != state.end() && same_value(s.value, known->second)) {
+            report.unchanged++;
+            continue;
+        }
+        size_t w = chn ? config.stage(nullptr, chn, find_channel_attr(chn, s.attr), s.value,
+                                      Config_Transaction::default_rank(s.attr))
+                       : config.stage(dev->second, nullptr, find_device_attr(dev->second, s.attr), s.value,
+                                      Config_Transaction::default_rank(s.attr));
+        staged.emplace_back(w, &s);
+    }
+
+    // Results are indexed by write; a merged write carries the last value staged
+    report.results = config.commit();
+    std::vector<Profile_Setting const*> last(report.results.size());
+    for (auto& [w, s] : staged) {
+        last[w] = s;
+    }
+    for (auto& r : report.results) {
+        report.written += r.ok();
+    }
+    for (auto& [w, s] : staged) {
+        if (report.results[w].ok()) {
+            state[s->path()] = last[w]->value;
+        } else {
+            state.erase(s->path());
+            report.failed.push_back(s->path());
+        }
+    }
+    report.latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return report;
+}
+
+/*
+ * Frequency hopping on an ad9361-phy LO channel (altvoltage0 RX_LO or
+ * altvoltage1 TX_LO) through fastlock profiles. prepare() tunes to every
+ * frequency once and saves its synthesizer calibration; hops then recall a
+ * hardware slot instead of writing frequency, which recalibrates. Saved
+ * profiles beyond the hardware slots are loaded on demand, replacing the
+ * least recently used slot.
+ */
+class Fastlock_Hopper {
+public:
+    static constexpr int SLOTS = 8;
+private:
+    struct Slot {
+        long long frequency;    // 0 while empty
+        unsigned long long used;
+    };
+
+    iio_channel* lo;
+    Slot slots[SLOTS];
+    unsigned long long clock;
+    // Saved calibration per frequency, the fastlock_save bytes without the slot
+    std::unordered_map<long long, std::string> saved;
+    long long current;
+
+    Typed_Channel_Attribute<long long> attr(Attr<long long> a) const {
+        return Typed_Channel_Attribute<long long>(lo, a.key);
+    }
+
+    int load(long long freq);
+public:
+    Fastlock_Hopper(Channel const& lo_channel)
+        : lo(lo_channel.a), slots{}, clock(0), current(0) {
+    }
+
+    /*
+     * Tunes to each frequency once, stores its profile and saves it to
+     * host memory. Slots are reused in turn, so afterwards the last SLOTS
+     * frequencies stay loaded.
+     */
+    void prepare(std::vector<long long> const& frequencies);
+
+    // Recalls a hardware slot by index
+    void hop(int slot);
+
+    // Recalls the profile of a prepared frequency, loading it if needed
+    void hop_to(long long frequency);
+
+    // Plain frequency write, recalibrating the synthesizer
+    void tune(long long frequency) {
+        attr(ad9361::frequency) = frequency;
+        current = frequency;
+    }
+
+    // Slot holding frequency, or -1 when it is not loaded
+    int slot_of(long long frequency) const;
+
+    size_t size() const {
+        return saved.size();
+    }
+
+    long long frequency() const {
+        return current;
+    }
+};
+
+void Fastlock_Hopper::prepare(std::vector<long long> const& frequencies) {
+    for (size_t i = 0; i < frequencies.size(); i++) {
+        long long freq = frequencies[i];
+        int slot = i % SLOTS;
+        tune(freq);
+        attr(ad9361::fastlock_store) = slot;
+        // The driver reports the profile of the slot last written to fastlock_save
+        attr(ad9361::fastlock_save_slot) = slot;
+        std::string blob = Typed_Channel_Attribute<std::string>(lo, ad9361::fastlock_save.key).value();
+        size_t sep = blob.find(' ');
+        if (sep == std::string::npos) {
+            throw std::system_error{EPROTO, std::generic_category(), "bad fastlock profile " + blob};
+        }
+        saved[freq] = blob.substr(sep + 1);
+        slots[slot] = Slot{freq, ++clock};
+    }
+}
+
+int Fastlock_Hopper::slot_of(long long freq) const {
+    for (int i = 0; i < SLOTS; i++) {
+        if (slots[i].frequency == freq) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int Fastlock_Hopper::load(long long freq) {
+    auto profile = saved.find(freq);
+    if (profile == saved.end()) {
+        throw std::system_error{ENOENT, std::generic_category(), "frequency not prepared " + std::to_string(freq)};
+    }
+    int victim = 0;
+    for (int i = 1; i < SLOTS; i++) {
+        if (slots[i].used < slots[victim].used) {
+            victim = i;
+        }
+    }
+    std::string value = std::to_string(victim) + " " + profile->second;
+    Typed_Channel_Attribute<std::string>(lo, ad9361::fastlock_load.key) = value.c_str();
+    slots[victim] = Slot{freq, 0};
+    return victim;
+}
+
+void Fastlock_Hopper::hop(int slot) {
+    if (slot < 0 || slot >= SLOTS || slots[slot].frequency == 0) {
+        throw std::system_error{EINVAL, std::generic_category(), "empty fastlock slot " + std::to_string(slot)};
+    }
+    attr(ad9361::fastlock_recall) = slot;
+    slots[slot].used = ++clock;
+    current = slots[slot].frequency;
+}
+
+void Fastlock_Hopper::hop_to(long long freq) {
+    int slot = slot_of(freq);
+    hop(slot < 0 ? load(freq) : slot);
+}
@@ -0,0 +1,507 @@
+#pragma once
+
+#include "iioc++.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/*
+ * Runs fn(context, radio) for every context on its own thread and returns
+ * one future per radio, so bring-up of a rack takes about as long as the
+ * slowest radio instead of the sum. Each context is touched by exactly one
+ * task, libiio contexts are never shared between threads. Exceptions are
+ * delivered through the futures.
+ */
+template <typename F>
+auto for_each_radio(std::vector<Context*> const& contexts, F fn)
+    -> std::vector<std::future<decltype(fn(std::declval<Context&>(), size_t(0)))>>
+{
+    std::vector<std::future<decltype(fn(std::declval<Context&>(), size_t(0)))>> futures;
+    futures.reserve(contexts.size());
+    for (size_t i = 0; i < contexts.size(); i++) {
+        futures.push_back(std::async(std::launch::async, fn, std::ref(*contexts[i]), i));
+    }
+    return futures;
+}
+
+struct Radio_Config_Result {
+    size_t radio;
+    std::vector<Config_Result> results;
+    double seconds;                 // staging and commit of this radio
+
+    bool ok() const {
+        for (auto& r : results) {
+            if (!r.ok()) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+/*
+ * Configures many radios concurrently: stage(context, radio, transaction)
+ * fills one Config_Transaction per radio, committed on that radio's thread.
+ */
+std::vector<std::future<Radio_Config_Result>> configure_all(std::vector<Context*> const& contexts,
+        std::function<void(Context&, size_t, Config_Transaction&)> stage)
+{
+    return for_each_radio(contexts, [stage](Context& ctx, size_t radio) {
+        auto start = std::chrono::steady_clock::now();
+        Config_Transaction config;
+        stage(ctx, radio, config);
+        Radio_Config_Result r{radio, config.commit(), 0};
+        r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return r;
+    });
+}
+
+// Creates one context per URI concurrently
+std::vector<std::future<Context>> open_all(std::vector<std::string> const& uris) {
+    std::vector<std::future<Context>> futures;
+    futures.reserve(uris.size());
+    for (auto& uri : uris) {
+        futures.push_back(std::async(std::launch::async, [uri]() {
+            return Context("uri", uri);
+        }));
+    }
+    return futures;
+}
+
+struct Executor_Stats {
+    uint64_t requests;              // reads, writes and calls submitted
+    uint64_t round_trips;           // libiio attribute calls actually made
+    uint64_t batches;               // times the owner thread drained the queue
+};
+
+/*
+ * Serializes all attribute access to one Context on an owner thread.
+ * Callers on any thread submit reads, writes or arbitrary calls and get
+ * futures back. Whatever is queued when the owner wakes up is handled as
+ * one batch, its runs of reads, writes and calls in submission order:
+ * duplicate reads in a run of reads share one result, several keys of one
+ * object are fetched with a single iio_*_attr_read_all, and a run of
+ * writes is committed as one Config_Transaction, one write_all per object,
+ * so within the run writes go in rank and object order, not as submitted.
+ */
+class Context_Executor {
+    struct Request {
+        enum Kind { READ, WRITE, CALL } kind;
+        iio_device* dev;
+        iio_channel* chn;           // nullptr for device attributes
+        const char* key;            // owned by libiio
+        std::string value;
+        std::promise<std::string> read;
+        std::promise<void> written;
+        std::function<void(Context&)> call;
+    };
+
+    Context* ctx;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::vector<std::unique_ptr<Request>> queue;
+    bool stopping;
+    std::atomic<uint64_t> requests, round_trips, batches;
+    std::thread owner;
+
+    void submit(std::unique_ptr<Request> r);
+    void run();
+    void read_run(std::vector<std::unique_ptr<Request>>::iterator begin, std::vector<std::unique_ptr<Request>>::iterator end);
+    void write_run(std::vector<std::unique_ptr<Request>>::iterator begin, std::vector<std::unique_ptr<Request>>::iterator end);
+public:
+    Context_Executor(Context& context)
+        : ctx(&context), stopping(false), requests(0), round_trips(0), batches(0) {
+        owner = std::thread(&Context_Executor::run, this);
+    }
+
+    Context_Executor(const Context_Executor&) = delete;
+    Context_Executor& operator =(const Context_Executor&) = delete;
+
+    // Finishes the requests already queued
+    ~Context_Executor();
+
+    std::future<std::string> read(Device const& dev, std::string_view key);
+    std::future<std::string> read(Channel const& chn, std::string_view key);
+    std::future<void> write(Device const& dev, std::string_view key, std::string value);
+    std::future<void> write(Channel const& chn, std::string_view key, std::string value);
+
+    // Runs fn(context) on the owner thread, in order with the other requests
+    template <typename F>
+    auto call(F fn) -> std::future<decltype(fn(std::declval<Context&>()))> {
+        using R = decltype(fn(std::declval<Context&>()));
+        auto task = std::make_shared<std::packaged_task<R(Context&)>>(std::move(fn));
+        auto r = std::make_unique<Request>();
+        r->kind = Request::CALL;
+        r->call = [task](Context& c) {
+            (*task)(c);
+        };
+        auto f = task->get_future();
+        submit(std::move(r));
+        return f;
+    }
+
+    Executor_Stats stats() const {
+        return Executor_Stats{requests.load(), round_trips.load(), batches.load()};
+    }
+};
+
+Context_Executor::~Context_Executor() {
+    {
+        std::lock_guard<std::mutex> l(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    owner.join();
+}
+
+void Context_Executor::submit(std::unique_ptr<Request> r) {
+    requests++;
+    {
+        std::lock_guard<std::mutex> l(lock);
+        queue.push_back(std::move(r));
+    }
+    wake.notify_all();
+}
+
+std::future<std::string> Context_Executor::read(Device const& dev, std::string_view key) {
+    auto r = std::make_unique<Request>();
+    r->kind = Request::READ;
+    r->dev = dev.dev;
+    r->chn = nullptr;
+    r->key = find_device_attr(dev.dev, key);
+    auto f = r->read.get_future();
+    submit(std::move(r));
+    return f;
+}
+
+std::future<std::string> Context_Executor::read(Channel const& chn, std::string_view key) {
+    auto r = std::make_unique<Request>();
+    r->kind = Request::READ;
+    r->dev = nullptr;
+    r->chn = chn.a;
+    r->key = find_channel_attr(chn.a, key);
+    auto f = r->read.get_future();
+    submit(std::move(r));
+    return f;
+}
+
+std::future<void> Context_Executor::write(Device const& dev, std::string_view key, std::string value) {
+    auto r = std::make_unique<Request>();
+    r->kind = Request::WRITE;
+    r->dev = dev.dev;
+    r->chn = nullptr;
+    r->key = find_device_attr(dev.dev, key);
+    r->value = std::move(value);
+    auto f = r->written.get_future();
+    submit(std::move(r));
+    return f;
+}
+
+std::future<void> Context_Executor::write(Channel const& chn, std::string_view key, std::string value) {
+    auto r = std::make_unique<Request>();
+    r->kind = Request::WRITE;
+    r->dev = nullptr;
+    r->chn = chn.a;
+    r->key = find_channel_attr(chn.a, key);
+    r->value = std::move(value);
+    auto f = r->written.get_future();
+    submit(std::move(r));
+    return f;
+}
+
+void Context_Executor::run() {
+    std::vector<std::unique_ptr<Request>> batch;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> l(lock);
+            wake.wait(l, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            batch.swap(queue);
+        }
+        batches++;
+        // Runs of the same kind, so a read never overtakes an earlier write
+        auto begin = batch.begin();
+        while (begin != batch.end()) {
+            auto end = begin;
+            while (end != batch.end() && (*end)->kind == (*begin)->kind && (*begin)->kind != Request::CALL) {
+                ++end;
+            }
+            if ((*begin)->kind == Request::READ) {
+                read_run(begin, end);
+            } else if ((*begin)->kind == Request::WRITE) {
+                write_run(begin, end);
+            } else {
+                end = begin + 1;
+                (*begin)->call(*ctx);
+            }
+            begin = end;
+        }
+        batch.clear();
+    }
+}
+
+void Context_Executor::read_run(std::vector<std::unique_ptr<Request>>::iterator begin,
+                                std::vector<std::unique_ptr<Request>>::iterator end)
+{
+    // Distinct keys wanted per object
+    std::unordered_map<void*, std::vector<const char*>> keys;
+    for (auto it = begin; it != end; ++it) {
+        void* obj = (*it)->chn ? (void*)(*it)->chn : (void*)(*it)->dev;
+        auto& list = keys[obj];
+        if (std::find(list.begin(), list.end(), (*it)->key) == list.end()) {
+            list.push_back((*it)->key);
+        }
+    }
+
+    std::unordered_map<void*, Attribute_Cache> all;
+    std::unordered_map<void*, std::unordered_map<const char*, std::string>> single;
+    std::unordered_map<void*, std::exception_ptr> failed;
+    for (auto it = begin; it != end; ++it) {
+        Request& r = **it;
+        void* obj = r.chn ? (void*)r.chn : (void*)r.dev;
+        try {
+            if (failed.count(obj)) {
+                std::rethrow_exception(failed[obj]);
+            }
+            if (keys[obj].size() > 1) {
+                auto cached = all.find(obj);
+                if (cached == all.end()) {
+                    cached = all.emplace(obj, Attribute_Cache{}).first;
+                    round_trips++;
+                    try {
+                        if (r.chn) {
+                            refresh_channel_attrs(r.chn, &cached->second);
+                        } else {
+                            refresh_device_attrs(r.dev, &cached->second);
+                        }
+                    } catch (...) {
+                        failed[obj] = std::current_exception();
+                        throw;
+                    }
+                }
+                // Missing from the read-all (write-only or failed): read it on its own below
+                auto v = cached->second.values.find(r.key);
+                if (v != cached->second.values.end()) {
+                    r.read.set_value(v->second);
+                    continue;
+                }
+            }
+            auto& values = single[obj];
+            auto v = values.find(r.key);
+            if (v == values.end()) {
+                round_trips++;
+                std::string s = r.chn ? Typed_Channel_Attribute<std::string>(r.chn, r.key).value()
+                                      : Typed_Device_Attribute<std::string>(r.dev, r.key).value();
+                v = values.emplace(r.key, std::move(s)).first;
+            }
+            r.read.set_value(v->second);
+        } catch (...) {
+            r.read.set_exception(std::current_exception());
+        }
+    }
+}
+
+void Context_Executor::write_run(std::vector<std::unique_ptr<Request>>::iterator begin,
+                                 std::vector<std::unique_ptr<Request>>::iterator end)
+{
+    Config_Transaction config;
+    // Result index of every request; a later write to the same key replaces the staged one
+    std::vector<size_t> slot;
+    std::unordered_map<std::string, size_t> staged;
+    std::vector<void*> objects;
+    for (auto it = begin; it != end; ++it) {
+        Request& r = **it;
+        void* obj = r.chn ? (void*)r.chn : (void*)r.dev;
+        if (std::find(objects.begin(), objects.end(), obj) == objects.end()) {
+            objects.push_back(obj);
+        }
+        std::string id = std::to_string((uintptr_t)obj) + "/" + r.key;
+        auto found = staged.find(id);
+        if (found == staged.end()) {
+            found = staged.emplace(id, config.size()).first;
+        }
+        slot.push_back(found->second);
+        if (r.chn) {
+            config.set(Channel(r.chn), r.key, r.value);
+        } else {
+            config.set(Device(r.dev), r.key, r.value);
+        }
+    }
+
+    std::vector<Config_Result> results;
+    try {
+        results = config.commit();
+        round_trips += objects.size();
+    } catch (...) {
+        for (auto it = begin; it != end; ++it) {
+            (*it)->written.set_exception(std::current_exception());
+        }
+        return;
+    }
+    for (size_t i = 0; i < slot.size(); i++) {
+        Request& r = *begin[i];
+        int err = results[slot[i]].err;
+        if (err == 0) {
+            r.written.set_value();
+        } else {
+            r.written.set_exception(std::make_exception_ptr(
+                std::system_error{-err, std::generic_category(), std::string("attribute write error ") + r.key}));
+        }
+    }
+}
+
+struct Scan_Result {
+    std::string uri;
+    std::string description;
+};
+
+/*
+ * Lists the contexts found by iio_create_scan_context, e.g. for backends
+ * "ip", "usb" or "ip:usb"; nullptr scans every backend built into libiio.
+ */
+std::vector<Scan_Result> scan_contexts(const char* backends = nullptr) {
+    iio_scan_context* scan = iio_create_scan_context(backends, 0);
+    if (scan == nullptr) {
+        throw std::system_error{errno, std::generic_category(), "scan context not created"};
+    }
+    iio_context_info** info;
+    ssize_t n = iio_scan_context_get_info_list(scan, &info);
+    if (n < 0) {
+        iio_scan_context_destroy(scan);
+        throw std::system_error{(int)-n, std::generic_category(), "context scan error"};
+    }
+    std::vector<Scan_Result> found;
+    for (ssize_t i = 0; i < n; i++) {
+        found.push_back(Scan_Result{iio_context_info_get_uri(info[i]), iio_context_info_get_description(info[i])});
+    }
+    iio_context_info_list_free(info);
+    iio_scan_context_destroy(scan);
+    return found;
+}
+
+struct Probe_Result {
+    std::string uri;
+    int err;                        // 0 when the context was created, errno otherwise
+    double latency;                 // seconds to create the context or fail
+};
+
+/*
+ * Pool of warm contexts keyed by URI. checkout() hands out an idle context
+ * or creates one; the Lease returns it to the pool when it goes out of
+ * scope, unless discard() was called because the context failed.
+ */
+class Context_Pool {
+    std::mutex lock;
+    std::unordered_map<std::string, std::vector<std::unique_ptr<Context>>> idle;
+    std::atomic<uint64_t> hits, misses;
+
+    void put(std::string const& uri, std::unique_ptr<Context> ctx) {
+        std::lock_guard<std::mutex> l(lock);
+        idle[uri].push_back(std::move(ctx));
+    }
+public:
+    class Lease {
+        Context_Pool* pool;
+        std::string uri;
+        std::unique_ptr<Context> ctx;
+    public:
+        Lease(Context_Pool* p, std::string u, std::unique_ptr<Context> c) : pool(p), uri(std::move(u)), ctx(std::move(c)) {
+        }
+        Lease(Lease&&) = default;
+        Lease& operator =(Lease&&) = delete;
+
+        ~Lease() {
+            if (ctx) {
+                pool->put(uri, std::move(ctx));
+            }
+        }
+
+        Context& operator*() const {
+            return *ctx;
+        }
+
+        Context* operator->() const {
+            return ctx.get();
+        }
+
+        // Drops a broken context instead of returning it to the pool
+        void discard() {
+            ctx.reset();
+        }
+    };
+
+    Context_Pool() : hits(0), misses(0) {
+    }
+
+    // Idle context for uri, created if there is none
+    Lease checkout(std::string const& uri);
+
+    // Creates count contexts per URI concurrently and keeps them idle
+    std::vector<Probe_Result> warm(std::vector<std::string> const& uris, size_t count = 1);
+
+    size_t idle_count(std::string const& uri) {
+        std::lock_guard<std::mutex> l(lock);
+        auto it = idle.find(uri);
+        return it == idle.end() ? 0 : it->second.size();
+    }
+
+    // Checkouts served from the pool and those that created a context
+    uint64_t hit_count() const {
+        return hits;
+    }
+
+    uint64_t miss_count() const {
+        return misses;
+    }
+};
+
+Context_Pool::Lease Context_Pool::checkout(std::string const& uri) {
+    {
+        std::lock_guard<std::mutex> l(lock);
+        auto it = idle.find(uri);
+        if (it != idle.end() && !it->second.empty()) {
+            std::unique_ptr<Context> ctx = std::move(it->second.back());
+            it->second.pop_back();
+            hits++;
+            return Lease(this, uri, std::move(ctx));
+        }
+    }
+    misses++;
+    return Lease(this, uri, std::make_unique<Context>("uri", uri));
+}
+
+std::vector<Probe_Result> Context_Pool::warm(std::vector<std::string> const& uris, size_t count) {
+    using Probe = std::pair<Probe_Result, std::unique_ptr<Context>>;
+    std::vector<std::future<Probe>> futures;
+    for (auto& uri : uris) {
+        for (size_t i = 0; i < count; i++) {
+            futures.push_back(std::async(std::launch::async, [uri]() {
+                auto start = std::chrono::steady_clock::now();
+                Probe p{Probe_Result{uri, 0, 0}, nullptr};
+                try {
+                    p.second = std::make_unique<Context>("uri", uri);
+                } catch (std::system_error& e) {
+                    p.first.err = e.code().value() ? e.code().value() : EIO;
+                }
+                p.first.latency = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                return p;
+            }));
+        }
+    }
+
+    std::vector<Probe_Result> results;
+    for (auto& f : futures) {
+        Probe p = f.get();
+        if (p.second) {
+            put(p.first.uri, std::move(p.second));
+        }
+        results.push_back(p.first);
+    }
+    return results;
+}
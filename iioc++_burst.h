@@ -0,0 +1,384 @@
+#pragma once
+
+#include "iioc++.h"
+#include "iioc++_stream.h"
+#include <functional>
+
+struct Burst_Config {
+    std::string device = "cf-ad9361-lpc";
+    std::vector<std::string> channels = {"voltage0", "voltage1"};
+    std::string trigger;            // trigger device name or id, empty keeps the bound one
+    double trigger_rate = 0;        // sampling_frequency of the trigger (hrtimer), 0 leaves it
+    size_t samples = 4096;          // per burst
+    unsigned int armed = 4;         // kernel buffers queued for the coming bursts
+    size_t ring = 16;               // bursts kept, preallocated
+    Cancellation_Token* token = nullptr;    // cancels a capture() waiting for the trigger
+};
+
+struct Burst {
+    uint64_t sequence;
+    std::chrono::steady_clock::time_point completed;
+    double wait;                    // seconds blocked in refill for the trigger
+    double rearm;                   // seconds from the previous refill returning to this one starting
+    std::vector<std::complex<int16_t>> samples;
+    std::vector<int64_t> timestamps;    // empty without a timestamp channel
+};
+
+struct Burst_Stats {
+    uint64_t bursts;
+    double min_interval;            // between completions, seconds
+    double mean_interval;
+    double max_interval;
+    double mean_rearm;
+    double max_rearm;
+    double mean_wait;
+
+    // Bursts per second over the run
+    double rate() const {
+        return mean_interval > 0 ? 1 / mean_interval : 0;
+    }
+};
+
+/*
+ * Triggered burst capture on one buffer created once. The trigger is bound
+ * and the kernel keeps armed blocks queued, so events arriving while the
+ * host converts the last burst are still captured. Each refill hands its
+ * block to a preallocated ring slot with Buffer::exchange, without a copy
+ * or an allocation, and the host work between two refills, the re-arm
+ * time, is measured per burst. A burst stays valid until ring more bursts
+ * have been captured. The trigger and kernel buffer count are restored on
+ * destruction; with a token, cancel() ends a capture() waiting for a
+ * trigger that never comes, which then throws.
+ */
+class Burst_Capture {
+    Device dev;
+    Burst_Config config;
+    std::optional<Device> previous;     // trigger bound before, restored on destruction
+    bool rebound = false;
+    unsigned int previous_buffers;      // kernel buffer count before, restored on destruction
+    bool resized = false;
+    Buffer buffer;
+    std::optional<Cancellation_Token::Attach> attached;
+    std::vector<Burst> slots;
+    uint64_t next = 0;
+    std::chrono::steady_clock::time_point returned;
+    Burst_Stats totals{};
+    double interval_sum = 0;
+    double rearm_sum = 0;
+    double wait_sum = 0;
+
+    Buffer arm(Context& ctx);
+    void restore();
+public:
+    Burst_Capture(Context& ctx, Burst_Config const& c);
+    ~Burst_Capture();
+
+    Burst_Capture(const Burst_Capture&) = delete;
+    Burst_Capture& operator =(const Burst_Capture&) = delete;
+
+    // Blocks until the next burst
+    Burst const& capture();
+
+    // Burst by sequence number, nullptr once overwritten or not captured yet
+    Burst const* burst(uint64_t sequence) const {
+        if (sequence >= next || next - sequence > slots.size()) {
+            return nullptr;
+        }
+        return &slots[sequence % slots.size()];
+    }
+
+    Burst_Stats stats() const {
+        return totals;
+    }
+};
+
+Burst_Capture::Burst_Capture(Context& ctx, Burst_Config const& c)
+    : dev(ctx.devices[c.device]), config(c), buffer(arm(ctx))
+{
+    // The destructor does not run when the body throws, so the device is put back here
+    try {
+        slots.resize(std::max<size_t>(config.ring, 1));
+        for (auto& s : slots) {
+            s.samples.resize(config.samples);
+            s.timestamps.resize(buffer.timestamps().size());
+        }
+        if (config.token) {
+            attached.emplace(*config.token, buffer);
+        }
+    } catch (...) {
+        attached.reset();
+        buffer.destroy();
+        restore();
+        throw;
+    }
+}
+
+// Binds the trigger and queues the kernel blocks before the buffer exists
+Buffer Burst_Capture::arm(Context& ctx) {
+    Stream_Layout::plan(dev, std::vector<std::string_view>(config.channels.begin(), config.channels.end()), false);
+    if (!config.trigger.empty()) {
+        Device trig = ctx.devices[config.trigger];
+        if (!trig.is_trigger()) {
+            throw std::system_error{EINVAL, std::generic_category(), "not a trigger " + config.trigger};
+        }
+        if (config.trigger_rate > 0) {
+            trig.attributes["sampling_frequency"] = config.trigger_rate;
+        }
+        previous = dev.trigger();
+        dev.set_trigger(trig);
+        rebound = true;
+    }
+    try {
+        previous_buffers = dev.kernel_buffers();
+        dev.set_kernel_buffers(std::max(config.armed, 1u));
+        resized = true;
+        return Buffer(dev, config.samples);
+    } catch (...) {
+        restore();
+        throw;
+    }
+}
+
+Burst_Capture::~Burst_Capture() {
+    attached.reset();
+    buffer.destroy();
+    restore();
+}
+
+// Puts back the trigger and kernel buffer count from before, errors are ignored
+void Burst_Capture::restore() {
+    if (resized) {
+        resized = false;
+        try {
+            dev.set_kernel_buffers(previous_buffers);
+        } catch (std::system_error&) {
+        }
+    }
+    if (!rebound) {
+        return;
+    }
+    rebound = false;
+    try {
+        if (previous) {
+            dev.set_trigger(*previous);
+        } else {
+            dev.clear_trigger();
+        }
+    } catch (std::system_error&) {
+    }
+}
+
+Burst const& Burst_Capture::capture() {
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    ssize_t ret = buffer.refill();
+    auto done = clock::now();
+    if (ret < 0) {
+        throw std::system_error{(int)-ret, std::generic_category(), "burst refill error"};
+    }
+
+    Burst& b = slots[next % slots.size()];
+    buffer.exchange(b.samples, b.timestamps);
+    b.sequence = next;
+    b.wait = std::chrono::duration<double>(done - start).count();
+    b.rearm = next == 0 ? 0 : std::chrono::duration<double>(start - returned).count();
+
+    if (next > 0) {
+        double interval = std::chrono::duration<double>(done - slots[(next - 1) % slots.size()].completed).count();
+        totals.min_interval = next == 1 ? interval : std::min(totals.min_interval, interval);
+        totals.max_interval = std::max(totals.max_interval, interval);
+        interval_sum += interval;
+        totals.mean_interval = interval_sum / next;
+        rearm_sum += b.rearm;
+        totals.mean_rearm = rearm_sum / next;
+        totals.max_rearm = std::max(totals.max_rearm, b.rearm);
+    }
+    b.completed = done;
+    wait_sum += b.wait;
+    totals.bursts = ++next;
+    totals.mean_wait = wait_sum / next;
+    returned = done;
+    return b;
+}
+
+struct Threshold_Config {
+    double sample_rate;                         // samples per second, converts pre and post
+    std::chrono::microseconds pre{1000};        // history kept ahead of the trigger
+    std::chrono::microseconds post{1000};       // recorded from the trigger on
+    double threshold = -30;                     // dBFS of the mean power over a window
+    size_t window = 64;                         // samples per detector window
+    double full_scale = 2048;                   // 12-bit ADC samples
+};
+
+struct Threshold_Record {
+    uint64_t sequence;
+    uint64_t trigger;           // absolute index of the first sample of the window that crossed
+    uint64_t first;             // absolute index of samples[0]
+    size_t pre;                 // samples ahead of the trigger, fewer at start or after a gap
+    double power;               // dBFS of the triggering window
+    std::vector<std::complex<int16_t>> samples;     // pre plus post, shorter when a gap cut it
+};
+
+/*
+ * Software trigger on the RX path. Every block is appended to a circular
+ * history of the last pre samples; the detector sums re^2 + im^2 over
+ * fixed windows in integers and compares against the threshold scaled to
+ * the same units, so there is no log or division per window. When a window
+ * crosses, the history is copied once into a preallocated record and the
+ * record is completed from the following blocks, then handed to the
+ * handler, after which detection resumes. Blocks are identified by the
+ * absolute index of their first sample, e.g. from Sample_Timeline; a jump
+ * in it clears the history and ends a record early.
+ */
+class Threshold_Capture {
+public:
+    using Handler = std::function<void(Threshold_Record const& record)>;
+private:
+    Threshold_Config config;
+    Handler handler;
+    size_t pre_samples;
+    size_t post_samples;
+    int64_t limit;              // window power sum at the threshold
+    std::vector<std::complex<int16_t>> history;
+    size_t head = 0;            // next write position in history
+    size_t held = 0;            // valid samples in history
+    uint64_t next = 0;          // index expected of the next block
+    int64_t sum = 0;            // power of the window so far
+    size_t filled = 0;          // samples in the window so far
+    bool recording = false;
+    Threshold_Record record;
+
+    // Written so the compiler vectorizes it: one multiply-add per int16
+    static int64_t power(const std::complex<int16_t>* x, size_t n) {
+        const int16_t* p = (const int16_t*)x;
+        int64_t acc = 0;
+        for (size_t i = 0; i < 2 * n; i++) {
+            acc += (int32_t)p[i] * p[i];
+        }
+        return acc;
+    }
+
+    void remember(const std::complex<int16_t>* x, size_t n);
+    void begin(uint64_t trigger, int64_t window_power, uint64_t base);
+    size_t extend(const std::complex<int16_t>* x, size_t from, size_t n);
+    void finish();
+public:
+    Threshold_Capture(Threshold_Config const& c, Handler on_record);
+
+    // Next block, index is the absolute index of its first sample
+    void feed(const std::complex<int16_t>* samples, size_t n, uint64_t index);
+
+    void feed(Buffer const& buffer, uint64_t index) {
+        size_t n = buffer.end() - buffer.begin();
+        if (n > 0) {
+            feed(&*buffer.begin(), n, index);
+        }
+    }
+
+    // Records handed to the handler so far
+    uint64_t records() const {
+        return record.sequence;
+    }
+};
+
+Threshold_Capture::Threshold_Capture(Threshold_Config const& c, Handler on_record)
+    : config(c), handler(std::move(on_record))
+{
+    if (config.sample_rate <= 0 || config.window == 0 || config.full_scale <= 0) {
+        throw std::system_error{EINVAL, std::generic_category(), "bad threshold config"};
+    }
+    pre_samples = (size_t)(config.pre.count() * 1e-6 * config.sample_rate);
+    post_samples = std::max<size_t>((size_t)(config.post.count() * 1e-6 * config.sample_rate), 1);
+    limit = (int64_t)(config.window * config.full_scale * config.full_scale * std::pow(10, config.threshold / 10));
+    // A window reaching back into the previous block is still in the history
+    history.resize(pre_samples + config.window);
+    record.sequence = 0;
+    record.samples.reserve(pre_samples + post_samples);
+}
+
+void Threshold_Capture::remember(const std::complex<int16_t>* x, size_t n) {
+    if (n >= history.size()) {
+        x += n - history.size();
+        n = history.size();
+    }
+    size_t first = std::min(n, history.size() - head);
+    std::copy_n(x, first, history.begin() + head);
+    std::copy_n(x + first, n - first, history.begin());
+    head = (head + n) % history.size();
+    held = std::min(held + n, history.size());
+}
+
+// Starts a record whose history part ends at base, the start of the current block
+void Threshold_Capture::begin(uint64_t trigger, int64_t window_power, uint64_t base) {
+    uint64_t oldest = base - held;
+    uint64_t first = std::max(trigger >= pre_samples ? trigger - pre_samples : 0, oldest);
+    record.trigger = trigger;
+    record.first = first;
+    record.pre = trigger - first;
+    record.power = 10 * std::log10((window_power + 1e-20) / (config.window * config.full_scale * config.full_scale));
+    record.samples.clear();
+
+    // The one copy out of the history, in at most two runs
+    if (first < base) {
+        size_t count = base - first;
+        size_t start = (head + history.size() - count) % history.size();
+        size_t run = std::min(count, history.size() - start);
+        record.samples.insert(record.samples.end(), history.begin() + start, history.begin() + start + run);
+        record.samples.insert(record.samples.end(), history.begin(), history.begin() + (count - run));
+    }
+    recording = true;
+}
+
+// Appends samples from x[from] on, returns where the record stopped taking them
+size_t Threshold_Capture::extend(const std::complex<int16_t>* x, size_t from, size_t n) {
+    size_t want = record.pre + post_samples - record.samples.size();
+    size_t count = std::min(want, n - from);
+    record.samples.insert(record.samples.end(), x + from, x + from + count);
+    if (count == want) {
+        finish();
+    }
+    return from + count;
+}
+
+void Threshold_Capture::finish() {
+    recording = false;
+    if (handler) {
+        handler(record);
+    }
+    record.sequence++;
+}
+
+void Threshold_Capture::feed(const std::complex<int16_t>* samples, size_t n, uint64_t index) {
+    if (index != next) {
+        if (recording) {
+            finish();
+        }
+        held = 0;
+        sum = 0;
+        filled = 0;
+    }
+
+    size_t i = 0;
+    if (recording) {
+        i = extend(samples, 0, n);
+    }
+    while (!recording && i < n) {
+        size_t m = std::min(config.window - filled, n - i);
+        sum += power(samples + i, m);
+        filled += m;
+        i += m;
+        if (filled < config.window) {
+            break;
+        }
+        if (sum >= limit) {
+            uint64_t trigger = index + i - config.window;
+            begin(trigger, sum, index);
+            size_t from = record.first + record.samples.size() - index;
+            i = std::max(i, extend(samples, from, n));
+        }
+        sum = 0;
+        filled = 0;
+    }
+    remember(samples, n);
+    next = index + n;
+}
@@ -0,0 +1,691 @@
+#pragma once
+
+#include "iioc++.h"
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <ctime>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+struct Recorder_Config {
+    std::string path;                   // path.sigmf-data and .sigmf-meta, path-0000.sigmf-data... when rotating
+    double sample_rate = 0;             // SigMF core:sample_rate, 0 leaves it out
+    double frequency = 0;               // SigMF core:frequency of every capture, 0 leaves it out
+    std::string hw;                     // SigMF core:hw
+    size_t block_size = 1 << 20;        // bytes per write, rounded up to 4096
+    size_t blocks = 16;                 // preallocated, bounds the backlog
+    uint64_t rotate_bytes = 0;          // next file once this much is written, 0 never
+    std::chrono::seconds rotate_after{0};   // next file once open this long, 0 never
+    uint64_t preallocate = 0;           // fallocated per file, 0 uses rotate_bytes
+    bool direct = true;                 // O_DIRECT, dropped when the filesystem refuses it
+    bool uring = true;                  // io_uring, else a pwrite thread
+    bool wait = false;                  // append() waits for a free block instead of dropping samples
+
+    // Fills sample_rate, frequency (RX LO) and hw from the phy
+    void describe(Context& ctx, std::string const& phy = "ad9361-phy");
+};
+
+struct Recorder_Stats {
+    uint64_t samples;               // taken by append()
+    uint64_t dropped;               // samples dropped with every block in flight
+    uint64_t bytes;                 // written to disk
+    uint64_t files;                 // opened so far
+    size_t backlog;                 // blocks submitted and not written yet
+    size_t max_backlog;
+    double seconds;                 // from the first append() to the last completed write
+    int error;                      // errno of the last failed write, 0 when none
+    bool uring;                     // io_uring in use, else the pwrite thread
+    bool direct;                    // O_DIRECT in use
+
+    // Sustained disk throughput
+    double bytes_per_second() const {
+        return seconds > 0 ? bytes / seconds : 0;
+    }
+};
+
+/*
+ * Submission and completion rings of io_uring over the raw system calls,
+ * for the vectored writes of Recorder only, so liburing is not needed.
+ * Used by one thread.
+ */
+class Uring {
+    int fd = -1;
+    unsigned entries = 0;
+    void* sq_map = MAP_FAILED;
+    size_t sq_size = 0;
+    void* cq_map = MAP_FAILED;
+    size_t cq_size = 0;
+    io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+    size_t sqes_size = 0;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+
+    // Queued entries the kernel has not consumed yet
+    unsigned pending() const {
+        return *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    }
+public:
+    Uring() = default;
+    ~Uring() {
+        release();
+    }
+
+    Uring(const Uring&) = delete;
+    Uring& operator =(const Uring&) = delete;
+
+    // 0 or the errno of a kernel without io_uring or refusing it
+    int setup(unsigned depth);
+    void release();
+
+    bool ready() const {
+        return fd >= 0;
+    }
+
+    /*
+     * Queues one writev and submits everything queued. -EBUSY when the queue
+     * is full and nothing was queued; any other -errno is a failed submit
+     * that leaves the entry queued for the next enter to pick up.
+     */
+    int writev(int file, const iovec* iov, uint64_t offset, uint64_t tag);
+
+    // Calls fn(tag, result) per completion, waits for one when wait; -errno on failure
+    template <typename F>
+    ssize_t reap(bool wait, F fn);
+};
+
+/*
+ * Sink writing RX samples to SigMF recordings without blocking the refill
+ * loop. append() copies each block once into preallocated 4096-aligned
+ * blocks, swapping to the I then Q order of ci16_le, and hands full ones
+ * to io_uring as O_DIRECT writes at increasing offsets of a preallocated
+ * file; completions are reaped on the next append(), so the calling thread
+ * never waits for the disk. Where io_uring is unavailable a writer thread
+ * does pwrite() instead. When every block is still in flight the samples
+ * are dropped and counted, or waited for with wait. Files rotate by size or
+ * age at block boundaries; each is truncated to its samples and gets its
+ * .sigmf-meta when its last write completes. A jump of the sample index,
+ * from a gap upstream or a drop here, starts a new SigMF capture with its
+ * core:global_index, so the metadata stays true to the stream. Used by one
+ * thread, e.g. the RX handler of Stream_Manager.
+ */
+class Recorder {
+    struct File {
+        int fd;
+        std::string base;           // path without the SigMF extension
+        uint64_t written = 0;       // bytes handed to writes, padded to the alignment
+        uint64_t samples = 0;
+        size_t in_flight = 0;
+        bool closing = false;
+        std::chrono::steady_clock::time_point opened;
+        std::string datetime;       // ISO 8601 UTC of the first sample
+        std::vector<std::pair<uint64_t, uint64_t>> captures;    // sample_start, global_index
+    };
+
+    struct Block {
+        char* data;
+        size_t used;
+        File* file;
+        uint64_t offset;
+        iovec iov;
+        ssize_t result;             // of the pwrite thread
+    };
+
+    static constexpr size_t alignment = 4096;
+
+    Recorder_Config config;
+    bool rotating;
+    bool direct;
+    std::vector<Block> blocks;      // never resized, blocks are handed out by address
+    std::vector<Block*> idle;
+    std::vector<std::unique_ptr<File>> files;   // open, the last one takes samples
+    Block* current = nullptr;
+    uint64_t expected = 0;          // index of the next sample contiguous with the file
+    uint64_t next = 0;              // index after the last append(), taken or dropped
+    Recorder_Stats totals{};
+    std::chrono::steady_clock::time_point first;
+    std::chrono::steady_clock::time_point last;
+    bool closed = false;
+    Uring ring;
+
+    // pwrite thread
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<Block*> queued;
+    std::deque<Block*> done;
+    bool stopping = false;
+    std::thread writer;
+
+    bool due(File const& f) const;
+    void open_file(uint64_t index);
+    Block* take(uint64_t index);
+    void submit(Block* b);
+    void complete(Block* b, ssize_t result);
+    void finish(File* f);
+    void write_meta(File const& f);
+    ssize_t reap(bool wait);
+    void write_loop();
+public:
+    Recorder(Recorder_Config const& c);
+    ~Recorder();
+
+    Recorder(const Recorder&) = delete;
+    Recorder& operator =(const Recorder&) = delete;
+
+    // Next block, index is the absolute index of its first sample, e.g. from Sample_Timeline
+    void append(const std::complex<int16_t>* samples, size_t n, uint64_t index);
+
+    void append(Buffer const& buffer, uint64_t index) {
+        size_t n = buffer.end() - buffer.begin();
+        if (n > 0) {
+            append(&*buffer.begin(), n, index);
+        }
+    }
+
+    // Contiguous with the previous block
+    void append(const std::complex<int16_t>* samples, size_t n) {
+        append(samples, n, next);
+    }
+
+    // Writes the partial block, waits for every write and completes the last file
+    void close();
+
+    // Also reaps the completions so far
+    Recorder_Stats stats() {
+        if (!closed) {
+            reap(false);
+        }
+        return totals;
+    }
+};
+
+int Uring::setup(unsigned depth) {
+    io_uring_params p{};
+    int ring = (int)syscall(__NR_io_uring_setup, depth, &p);
+    if (ring < 0) {
+        return errno;
+    }
+    fd = ring;
+    entries = p.sq_entries;
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        sq_size = cq_size = std::max(sq_size, cq_size);
+    }
+
+    sq_map = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_map != MAP_FAILED) {
+        cq_map = single ? sq_map : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                        fd, IORING_OFF_CQ_RING);
+    }
+    if (cq_map != MAP_FAILED) {
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                   fd, IORING_OFF_SQES);
+    }
+    if (sqes == MAP_FAILED) {
+        int err = errno;
+        release();
+        return err;
+    }
+
+    char* sq = (char*)sq_map;
+    sq_head = (unsigned*)(sq + p.sq_off.head);
+    sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq + p.sq_off.array);
+    char* cq = (char*)cq_map;
+    cq_head = (unsigned*)(cq + p.cq_off.head);
+    cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+void Uring::release() {
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqes_size);
+    }
+    if (cq_map != MAP_FAILED && cq_map != sq_map) {
+        munmap(cq_map, cq_size);
+    }
+    if (sq_map != MAP_FAILED) {
+        munmap(sq_map, sq_size);
+    }
+    sqes = (io_uring_sqe*)MAP_FAILED;
+    cq_map = sq_map = MAP_FAILED;
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+int Uring::writev(int file, const iovec* iov, uint64_t offset, uint64_t tag) {
+    unsigned tail = *sq_tail;
+    if (pending() >= entries) {
+        return -EBUSY;
+    }
+    unsigned index = tail & *sq_mask;
+    io_uring_sqe* sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = file;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = 1;
+    sqe->off = offset;
+    sqe->user_data = tag;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (syscall(__NR_io_uring_enter, fd, pending(), 0, 0, nullptr, 0) < 0) {
+        // Left queued, the next call submits it
+        if (errno == EAGAIN || errno == EBUSY || errno == EINTR) {
+            return 0;
+        }
+        return -errno;
+    }
+    return 0;
+}
+
+template <typename F>
+ssize_t Uring::reap(bool wait, F fn) {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail && (wait || pending() > 0)) {
+        unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+        if (syscall(__NR_io_uring_enter, fd, pending(), wait ? 1 : 0, flags, nullptr, 0) < 0 && errno != EINTR) {
+            return -errno;
+        }
+        tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    }
+    ssize_t n = 0;
+    for (; head != tail; head++, n++) {
+        io_uring_cqe const& c = cqes[head & *cq_mask];
+        fn(c.user_data, c.res);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+void Recorder_Config::describe(Context& ctx, std::string const& phy) {
+    Device dev = ctx.devices[phy];
+    sample_rate = (double)dev.in["voltage0"].attributes[ad9361::sampling_frequency].value();
+    frequency = (double)dev.out["altvoltage0"].attributes[ad9361::frequency].value();
+    hw = phy;
+}
+
+Recorder::Recorder(Recorder_Config const& c) : config(c) {
+    if (config.path.empty()) {
+        throw std::system_error{EINVAL, std::generic_category(), "recorder needs a path"};
+    }
+    config.block_size = std::max<size_t>((config.block_size + alignment - 1) / alignment * alignment, alignment);
+    config.blocks = std::max<size_t>(config.blocks, 1);
+    rotating = config.rotate_bytes > 0 || config.rotate_after.count() > 0;
+    direct = config.direct;
+
+    blocks.resize(config.blocks);
+    for (auto& b : blocks) {
+        void* p = nullptr;
+        if (posix_memalign(&p, alignment, config.block_size) != 0) {
+            for (auto& a : blocks) {
+                free(a.data);
+            }
+            throw std::system_error{ENOMEM, std::generic_category(), "recorder blocks not allocated"};
+        }
+        // Touched now so the first writes do not fault
+        std::memset(p, 0, config.block_size);
+        b = Block{(char*)p, 0, nullptr, 0, {}, 0};
+        idle.push_back(&b);
+    }
+
+    if (!config.uring || ring.setup((unsigned)config.blocks) != 0) {
+        writer = std::thread(&Recorder::write_loop, this);
+    }
+    totals.uring = ring.ready();
+    totals.direct = direct;
+}
+
+Recorder::~Recorder() {
+    try {
+        close();
+    } catch (std::system_error&) {
+    }
+    if (writer.joinable()) {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            stopping = true;
+        }
+        changed.notify_all();
+        writer.join();
+    }
+    ring.release();
+    for (auto& b : blocks) {
+        free(b.data);
+    }
+}
+
+bool Recorder::due(File const& f) const {
+    if (config.rotate_bytes > 0 && f.written >= config.rotate_bytes) {
+        return true;
+    }
+    return config.rotate_after.count() > 0 && std::chrono::steady_clock::now() - f.opened >= config.rotate_after;
+}
+
+void Recorder::open_file(uint64_t index) {
+    std::string base = config.path;
+    if (rotating) {
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "-%04llu", (unsigned long long)totals.files);
+        base += suffix;
+    }
+    std::string data = base + ".sigmf-data";
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    int fd = ::open(data.c_str(), flags | (direct ? O_DIRECT : 0), 0644);
+    if (fd < 0 && direct && errno == EINVAL) {
+        // tmpfs and some network filesystems have no O_DIRECT
+        direct = false;
+        totals.direct = false;
+        fd = ::open(data.c_str(), flags, 0644);
+    }
+    if (fd < 0) {
+        throw std::system_error{errno, std::generic_category(), "cannot open " + data};
+    }
+
+    // Writes inside the allocation update no extents; the file is truncated on completion
+    uint64_t size = config.preallocate > 0 ? config.preallocate : config.rotate_bytes;
+    if (size > 0) {
+        size = (size + config.block_size - 1) / config.block_size * config.block_size;
+        fallocate(fd, 0, 0, size);
+    }
+
+    auto f = std::make_unique<File>();
+    f->fd = fd;
+    f->base = std::move(base);
+    f->opened = std::chrono::steady_clock::now();
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    tm utc;
+    gmtime_r(&now.tv_sec, &utc);
+    char stamp[64];
+    size_t len = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &utc);
+    snprintf(stamp + len, sizeof(stamp) - len, ".%06ldZ", now.tv_nsec / 1000);
+    f->datetime = stamp;
+    f->captures.emplace_back(0, index);
+    files.push_back(std::move(f));
+    totals.files++;
+}
+
+// Block for the samples from index on, nullptr when every block is in flight
+Recorder::Block* Recorder::take(uint64_t index) {
+    if (files.empty() || due(*files.back())) {
+        if (!files.empty()) {
+            File* old = files.back().get();
+            old->closing = true;
+            if (old->in_flight == 0) {
+                finish(old);
+            }
+        }
+        open_file(index);
+        expected = index;
+    }
+    if (idle.empty()) {
+        reap(false);
+    }
+    while (idle.empty() && config.wait) {
+        if (reap(true) < 0) {
+            break;
+        }
+    }
+    if (idle.empty()) {
+        return nullptr;
+    }
+    Block* b = idle.back();
+    idle.pop_back();
+    b->used = 0;
+    b->file = files.back().get();
+    return b;
+}
+
+void Recorder::append(const std::complex<int16_t>* samples, size_t n, uint64_t index) {
+    if (closed) {
+        throw std::system_error{EBADF, std::generic_category(), "recorder closed"};
+    }
+    if (totals.samples == 0 && totals.dropped == 0) {
+        first = last = std::chrono::steady_clock::now();
+        expected = index;
+    }
+    next = index + n;
+    reap(false);
+
+    while (n > 0) {
+        if (!current && !(current = take(index))) {
+            // expected stays behind, so the next samples start a new capture
+            totals.dropped += n;
+            return;
+        }
+        File& f = *current->file;
+        if (index != expected) {
+            if (f.captures.back().first == f.samples) {
+                f.captures.back().second = index;
+            } else {
+                f.captures.emplace_back(f.samples, index);
+            }
+        }
+
+        size_t m = std::min(n, (config.block_size - current->used) / sizeof(*samples));
+        // Q, I to I, Q; vectorized into a shuffle
+        const int16_t* in = (const int16_t*)samples;
+        int16_t* out = (int16_t*)(current->data + current->used);
+        for (size_t i = 0; i < m; i++) {
+            out[2 * i] = in[2 * i + 1];
+            out[2 * i + 1] = in[2 * i];
+        }
+        current->used += m * sizeof(*samples);
+        f.samples += m;
+        totals.samples += m;
+        samples += m;
+        n -= m;
+        index += m;
+        expected = index;
+
+        if (current->used == config.block_size) {
+            submit(current);
+            current = nullptr;
+        }
+    }
+}
+
+void Recorder::submit(Block* b) {
+    File& f = *b->file;
+    // Only the last block of a file is partial; the padding is truncated away
+    size_t len = (b->used + alignment - 1) / alignment * alignment;
+    std::memset(b->data + b->used, 0, len - b->used);
+    b->iov = iovec{b->data, len};
+    b->offset = f.written;
+    f.written += len;
+    f.in_flight++;
+    totals.backlog++;
+    totals.max_backlog = std::max(totals.max_backlog, totals.backlog);
+
+    if (ring.ready()) {
+        int err = ring.writev(f.fd, &b->iov, b->offset, (uint64_t)(b - blocks.data()));
+        if (err == -EBUSY) {
+            complete(b, err);
+        } else if (err < 0) {
+            // Already queued, its completion returns the block
+            totals.error = -err;
+        }
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> l(lock);
+        queued.push_back(b);
+    }
+    changed.notify_all();
+}
+
+void Recorder::complete(Block* b, ssize_t result) {
+    File* f = b->file;
+    if (result < 0) {
+        totals.error = (int)-result;
+    } else {
+        if ((size_t)result < b->iov.iov_len) {
+            totals.error = ENOSPC;
+        }
+        totals.bytes += result;
+    }
+    last = std::chrono::steady_clock::now();
+    totals.seconds = std::chrono::duration<double>(last - first).count();
+    totals.backlog--;
+    f->in_flight--;
+    b->file = nullptr;
+    idle.push_back(b);
+    if (f->closing && f->in_flight == 0) {
+        finish(f);
+    }
+}
+
+// Completions so far, at least one when wait; -errno when io_uring failed
+ssize_t Recorder::reap(bool wait) {
+    if (ring.ready()) {
+        return ring.reap(wait, [this](uint64_t tag, int32_t result) {
+            complete(&blocks[tag], result);
+        });
+    }
+    std::deque<Block*> finished;
+    {
+        std::unique_lock<std::mutex> l(lock);
+        if (wait) {
+            changed.wait(l, [this]() { return !done.empty(); });
+        }
+        finished.swap(done);
+    }
+    for (Block* b : finished) {
+        complete(b, b->result);
+    }
+    return finished.size();
+}
+
+void Recorder::write_loop() {
+    std::unique_lock<std::mutex> l(lock);
+    for (;;) {
+        changed.wait(l, [this]() { return !queued.empty() || stopping; });
+        if (queued.empty()) {
+            return;
+        }
+        Block* b = queued.front();
+        queued.pop_front();
+        int fd = b->file->fd;
+        l.unlock();
+
+        size_t put = 0;
+        ssize_t ret = 0;
+        while (put < b->iov.iov_len) {
+            ret = pwrite(fd, b->data + put, b->iov.iov_len - put, b->offset + put);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                break;
+            }
+            put += ret;
+        }
+        b->result = ret < 0 ? -errno : (ssize_t)put;
+
+        l.lock();
+        done.push_back(b);
+        changed.notify_all();
+    }
+}
+
+// Truncates away the preallocation and padding, closes and writes the metadata
+void Recorder::finish(File* f) {
+    if (ftruncate(f->fd, f->samples * sizeof(std::complex<int16_t>)) < 0) {
+        totals.error = errno;
+    }
+    ::close(f->fd);
+    write_meta(*f);
+    files.erase(std::find_if(files.begin(), files.end(), [f](auto& x) { return x.get() == f; }));
+}
+
+void Recorder::write_meta(File const& f) {
+    auto quote = [](std::string const& s) {
+        std::string q = "\"";
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                q += '\\';
+            }
+            q += c;
+        }
+        return q + "\"";
+    };
+
+    std::ofstream out(f.base + ".sigmf-meta");
+    out.precision(15);
+    out << "{\n    \"global\": {\n";
+    out << "        \"core:datatype\": \"ci16_le\",\n";
+    out << "        \"core:version\": \"1.0.0\",\n";
+    out << "        \"core:num_channels\": 1,\n";
+    if (config.sample_rate > 0) {
+        out << "        \"core:sample_rate\": " << config.sample_rate << ",\n";
+    }
+    if (!config.hw.empty()) {
+        out << "        \"core:hw\": " << quote(config.hw) << ",\n";
+    }
+    out << "        \"core:recorder\": \"iioc++\"\n    },\n";
+    out << "    \"captures\": [";
+    for (size_t i = 0; i < f.captures.size(); i++) {
+        out << (i ? ",\n" : "\n") << "        {\"core:sample_start\": " << f.captures[i].first
+            << ", \"core:global_index\": " << f.captures[i].second;
+        if (config.frequency > 0) {
+            out << ", \"core:frequency\": " << config.frequency;
+        }
+        if (i == 0) {
+            out << ", \"core:datetime\": " << quote(f.datetime);
+        }
+        out << "}";
+    }
+    out << "\n    ],\n    \"annotations\": []\n}\n";
+    if (!out) {
+        totals.error = EIO;
+    }
+}
+
+void Recorder::close() {
+    if (closed) {
+        return;
+    }
+    closed = true;
+    if (current) {
+        if (current->used > 0) {
+            submit(current);
+        } else {
+            idle.push_back(current);
+        }
+        current = nullptr;
+    }
+    if (!files.empty()) {
+        files.back()->closing = true;
+    }
+    while (totals.backlog > 0) {
+        if (reap(true) < 0) {
+            break;
+        }
+    }
+    while (!files.empty()) {
+        finish(files.back().get());
+    }
+}
@@ -0,0 +1,654 @@
+#pragma once
+
+#include "iioc++.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <mutex>
+#include <optional>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Cancellation usable from a signal handler. cancel() only sets a
+ * lock-free flag and writes one byte to a pipe, both async-signal-safe.
+ * A watcher thread wakes on the pipe and calls iio_buffer_cancel, which is
+ * not signal-safe, on every attached buffer, so a refill() or push()
+ * blocked on a large transfer returns at once with an error. Buffers must
+ * be detached before they are destroyed; Cancellation_Token::Attach does
+ * both in scope order.
+ */
+class Cancellation_Token {
+    static_assert(std::atomic<bool>::is_always_lock_free);
+
+    std::atomic<bool> flag;
+    std::atomic<bool> closing;
+    int fds[2];
+    std::mutex lock;
+    std::vector<iio_buffer*> buffers;
+    std::thread watcher;
+
+    void watch();
+    void attach(iio_buffer* buf);
+    void detach(iio_buffer* buf);
+public:
+    Cancellation_Token();
+    ~Cancellation_Token();
+
+    Cancellation_Token(const Cancellation_Token&) = delete;
+    Cancellation_Token& operator =(const Cancellation_Token&) = delete;
+
+    // Async-signal-safe
+    void cancel() {
+        flag.store(true);
+        char c = 0;
+        ssize_t ret = write(fds[1], &c, 1);
+        (void)ret;
+    }
+
+    bool cancelled() const {
+        return flag.load();
+    }
+
+    // Clears the flag for a restart; cancelled buffers stay unusable
+    void reset() {
+        flag.store(false);
+    }
+
+    // Cancels buf right away when the token is already cancelled
+    void attach(Buffer& buf) {
+        attach(buf.a);
+    }
+    void detach(Buffer& buf) {
+        detach(buf.a);
+    }
+
+    // Holds the iio_buffer taken at construction, so moving the Buffer keeps it attached
+    class Attach {
+        Cancellation_Token& token;
+        iio_buffer* buf;
+    public:
+        Attach(Cancellation_Token& t, Buffer& b) : token(t), buf(b.a) {
+            token.attach(buf);
+        }
+        ~Attach() {
+            token.detach(buf);
+        }
+
+        Attach(const Attach&) = delete;
+        Attach& operator =(const Attach&) = delete;
+    };
+};
+
+Cancellation_Token::Cancellation_Token() : flag(false), closing(false) {
+    if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) < 0) {
+        throw std::system_error{errno, std::generic_category(), "cancellation pipe not created"};
+    }
+    watcher = std::thread(&Cancellation_Token::watch, this);
+}
+
+Cancellation_Token::~Cancellation_Token() {
+    closing.store(true);
+    char c = 0;
+    ssize_t ret = write(fds[1], &c, 1);
+    (void)ret;
+    watcher.join();
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void Cancellation_Token::watch() {
+    pollfd p{fds[0], POLLIN, 0};
+    while (!closing.load()) {
+        if (poll(&p, 1, -1) < 0 && errno != EINTR) {
+            return;
+        }
+        char drain[64];
+        while (read(fds[0], drain, sizeof(drain)) > 0) {
+        }
+        if (flag.load()) {
+            std::lock_guard<std::mutex> l(lock);
+            for (auto b : buffers) {
+                iio_buffer_cancel(b);
+            }
+        }
+    }
+}
+
+void Cancellation_Token::attach(iio_buffer* buf) {
+    if (buf == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> l(lock);
+    buffers.push_back(buf);
+    if (flag.load()) {
+        iio_buffer_cancel(buf);
+    }
+}
+
+void Cancellation_Token::detach(iio_buffer* buf) {
+    std::lock_guard<std::mutex> l(lock);
+    buffers.erase(std::remove(buffers.begin(), buffers.end(), buf), buffers.end());
+}
+
+/*
+ * Realtime settings for a streaming thread. apply_realtime() applies them
+ * to the calling thread and reports each one separately: -1 when it was
+ * not requested, 0 when applied, otherwise the errno (EPERM without
+ * CAP_SYS_NICE or CAP_IPC_LOCK and a sufficient RLIMIT_MEMLOCK).
+ */
+struct Realtime_Config {
+    int core = -1;                  // CPU to pin to, -1 leaves the affinity alone
+    int priority = 0;               // SCHED_FIFO priority 1-99, 0 keeps the default policy
+    bool lock_memory = false;       // mlockall current and future memory
+    bool prefault = false;          // touch and, with lock_memory, lock sample buffers
+};
+
+struct Realtime_Report {
+    int affinity = -1;
+    int priority = -1;
+    int locked = -1;
+    int prefaulted = -1;
+
+    static const char* describe(int status) {
+        return status < 0 ? "not requested" : status == 0 ? "applied" : strerror(status);
+    }
+};
+
+Realtime_Report apply_realtime(Realtime_Config const& config) {
+    Realtime_Report r;
+    if (config.core >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(config.core, &set);
+        r.affinity = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    if (config.priority > 0) {
+        sched_param param{};
+        param.sched_priority = config.priority;
+        r.priority = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    }
+    if (config.lock_memory) {
+        r.locked = mlockall(MCL_CURRENT | MCL_FUTURE) < 0 ? errno : 0;
+    }
+    return r;
+}
+
+// Ways a gap was noticed, combined in Gap_Event::sources
+enum Gap_Source : unsigned {
+    gap_timing = 1,         // a block completed later than the kernel queue could hide
+    gap_timestamp = 2,      // hardware timestamps jumped
+    gap_status = 4,         // the device latched an overflow or underflow
+};
+
+struct Gap_Event {
+    uint64_t index;         // absolute index of the first sample after the gap
+    uint64_t lost;          // samples missing, 0 when only the status flag tells
+    unsigned sources;       // Gap_Source bits
+    std::chrono::steady_clock::time_point when;
+};
+
+struct Timeline_Stats {
+    uint64_t position;      // absolute index of the next sample, lost samples included
+    uint64_t samples;       // delivered
+    uint64_t gaps;
+    uint64_t lost;
+};
+
+/*
+ * Absolute sample index of one stream. Every refilled or pushed block
+ * advances it by its length plus the samples lost before it, so consumers
+ * can realign after a discontinuity instead of treating blocks as
+ * contiguous. Losses come from the hardware timestamp of the first sample
+ * of each block when there is one, otherwise from completion times
+ * against the sample rate: a block completing later than the kernel queue
+ * (slack) could have hidden means the hardware dropped the difference.
+ * Half a block of scheduling jitter is tolerated, and the estimate is
+ * re-anchored whenever the stream runs ahead of it, so a fast sample
+ * clock does not build up into false gaps.
+ */
+class Sample_Timeline {
+public:
+    using clock = std::chrono::steady_clock;
+private:
+    double rate;            // samples per second, 0 disables timing detection
+    double slack;           // samples the kernel queue holds
+    double period;          // timestamp increment per sample
+    uint64_t next = 0;
+    uint64_t delivered = 0;
+    uint64_t gap_count = 0;
+    uint64_t lost_count = 0;
+    clock::time_point anchor;       // when sample 0 was taken, as far as timing tells
+    bool stamped = false;
+    long long last_stamp = 0;
+    size_t last_length = 0;
+    bool flagged = false;
+    std::vector<Gap_Event> pending;
+
+    uint64_t timing_loss(size_t samples, clock::time_point completed);
+    uint64_t record(size_t samples, uint64_t lost, unsigned sources, clock::time_point completed);
+public:
+    static constexpr size_t max_pending = 1024;
+
+    /*
+     * queue_slack is buffers times samples per buffer of the kernel queue,
+     * timestamp_period the timestamp increment per sample, 0 for
+     * nanoseconds at sample_rate.
+     */
+    Sample_Timeline(double sample_rate = 0, uint64_t queue_slack = 0, double timestamp_period = 0)
+        : rate(sample_rate), slack(queue_slack),
+          period(timestamp_period > 0 ? timestamp_period : sample_rate > 0 ? 1e9 / sample_rate : 1)
+    {
+    }
+
+    // Records the next block, returns the absolute index of its first sample
+    uint64_t advance(size_t samples, clock::time_point completed = clock::now());
+    // Same, with the hardware timestamp of its first sample
+    uint64_t advance(size_t samples, long long timestamp, clock::time_point completed = clock::now());
+
+    // The device latched an overflow or underflow, charged to the next block
+    void flag() {
+        flagged = true;
+    }
+
+    uint64_t position() const {
+        return next;
+    }
+
+    Timeline_Stats stats() const {
+        return Timeline_Stats{next, delivered, gap_count, lost_count};
+    }
+
+    // Gaps since the last call, the oldest dropped beyond max_pending
+    std::vector<Gap_Event> take_gaps() {
+        return std::exchange(pending, {});
+    }
+};
+
+uint64_t Sample_Timeline::timing_loss(size_t samples, clock::time_point completed) {
+    if (rate <= 0) {
+        return 0;
+    }
+    auto start_of = [&](uint64_t end) {
+        return completed - std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(end / rate));
+    };
+    if (delivered == 0) {
+        anchor = start_of(samples);
+        return 0;
+    }
+    // Samples taken by now but still queued behind this block
+    double behind = std::chrono::duration<double>(completed - anchor).count() * rate - (double)(next + samples);
+    if (behind < 0) {
+        anchor = start_of(next + samples);
+        return 0;
+    }
+    if (behind <= slack + samples / 2.0) {
+        return 0;
+    }
+    return (uint64_t)std::llround(behind - slack);
+}
+
+uint64_t Sample_Timeline::record(size_t samples, uint64_t lost, unsigned sources, clock::time_point completed) {
+    if (flagged) {
+        sources |= gap_status;
+        flagged = false;
+    }
+    uint64_t first = next + lost;
+    if (sources != 0) {
+        gap_count++;
+        lost_count += lost;
+        if (pending.size() >= max_pending) {
+            pending.erase(pending.begin());
+        }
+        pending.push_back(Gap_Event{first, lost, sources, completed});
+    }
+    next = first + samples;
+    delivered += samples;
+    return first;
+}
+
+uint64_t Sample_Timeline::advance(size_t samples, clock::time_point completed) {
+    uint64_t lost = timing_loss(samples, completed);
+    return record(samples, lost, lost ? (unsigned)gap_timing : 0u, completed);
+}
+
+uint64_t Sample_Timeline::advance(size_t samples, long long timestamp, clock::time_point completed) {
+    uint64_t lost = 0;
+    if (stamped) {
+        double missing = (timestamp - last_stamp) / period - (double)last_length;
+        if (missing >= 0.5) {
+            lost = (uint64_t)std::llround(missing);
+        }
+    }
+    stamped = true;
+    last_stamp = timestamp;
+    last_length = samples;
+    return record(samples, lost, lost ? (unsigned)gap_timestamp : 0u, completed);
+}
+
+/*
+ * Overflow (ADC) or underflow (DAC) flag the ADI AXI cores behind
+ * cf-ad9361-lpc and cf-ad9361-dds-core-lpc latch in their status register
+ * until it is written back. Every check is a register round-trip, over the
+ * network as well.
+ */
+class Xflow_Monitor {
+    Device dev;
+    uint32_t mask;
+    bool present;
+public:
+    static constexpr uint32_t status_reg = 0x80000088;
+    static constexpr uint32_t adc_overflow = 1 << 2;
+    static constexpr uint32_t dac_underflow = 1 << 0;
+
+    // Clears a stale flag; a device without the register is not available
+    Xflow_Monitor(Device device, bool output);
+
+    bool available() const {
+        return present;
+    }
+
+    // True when the flag was latched since the last check
+    bool check();
+};
+
+Xflow_Monitor::Xflow_Monitor(Device device, bool output)
+    : dev(device), mask(output ? dac_underflow : adc_overflow), present(true)
+{
+    check();
+}
+
+bool Xflow_Monitor::check() {
+    if (!present) {
+        return false;
+    }
+    try {
+        if ((dev.reg_read(status_reg) & mask) == 0) {
+            return false;
+        }
+        dev.reg_write(status_reg, mask);
+        return true;
+    } catch (std::system_error&) {
+        present = false;
+        return false;
+    }
+}
+
+struct Radio_Stream_Config {
+    std::string uri;
+    bool rx = true;
+    bool tx = false;
+    Realtime_Config rx_realtime;    // e.g. core and SCHED_FIFO priority of the RX thread
+    Realtime_Config tx_realtime;
+    size_t samples = 1 << 16;       // per buffer
+    std::chrono::milliseconds timeout{0};   // per-operation deadline, zero keeps libiio's default
+    double sample_rate = 0;         // for gap detection, 0 reads sampling_frequency of the first channel
+    double timestamp_period = 0;    // timestamp increment per sample, 0 for nanoseconds
+    bool check_status = false;      // poll overflow/underflow flags, a register round-trip per buffer
+    std::string rx_device = "cf-ad9361-lpc";
+    std::string tx_device = "cf-ad9361-dds-core-lpc";
+    std::vector<std::string> rx_channels = {"voltage0", "voltage1"};
+    std::vector<std::string> tx_channels = {"voltage0", "voltage1"};
+};
+
+struct Stream_Stats {
+    size_t radio;                   // index into the configs
+    bool output;
+    int core;                       // -1 when unpinned or pinning failed
+    Realtime_Report realtime;
+    uint64_t buffers;
+    uint64_t samples;
+    uint64_t bytes;
+    double seconds;
+    std::string error;              // last error, empty while healthy
+    uint64_t gaps;                  // discontinuities detected
+    uint64_t lost;                  // samples estimated lost in them
+
+    double samples_per_second() const {
+        return seconds > 0 ? samples / seconds : 0;
+    }
+
+    double bytes_per_second() const {
+        return seconds > 0 ? bytes / seconds : 0;
+    }
+};
+
+struct Stream_Gap {
+    size_t radio;
+    bool output;
+    Gap_Event gap;
+};
+
+/*
+ * Streams several radios at once, one Context per radio and one thread per
+ * RX or TX buffer, each pinned to its own core, so host throughput scales
+ * with cores rather than with one push/refill loop. Handlers run on the
+ * stream threads: rx gets every refilled buffer, tx fills each buffer
+ * before it is pushed. Both get the absolute index of the first sample in
+ * the stream's Sample_Timeline, which skips the samples lost in gaps.
+ */
+class Stream_Manager {
+public:
+    using Handler = std::function<void(size_t radio, Buffer& buffer, uint64_t index)>;
+private:
+    struct Stream {
+        size_t radio;
+        bool output;
+        Realtime_Report realtime;
+        std::atomic<uint64_t> buffers{0};
+        std::atomic<uint64_t> samples{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic<uint64_t> gaps{0};
+        std::atomic<uint64_t> lost{0};
+        // Set by the stream thread once its buffer exists, zero until then;
+        // realtime is written before it and read by stats() only after it
+        std::atomic<std::chrono::steady_clock::rep> started{0};
+        std::chrono::steady_clock::time_point stopped;
+        std::string error;
+        std::thread thread;
+    };
+
+    std::vector<Radio_Stream_Config> configs;
+    std::vector<Context> contexts;
+    std::vector<std::unique_ptr<Stream>> streams;
+    std::atomic<bool> running{false};
+    Cancellation_Token cancel;
+    std::mutex gaps_lock;
+    std::vector<Stream_Gap> gaps;
+
+    void run(Stream* s, Handler handler);
+public:
+    // Opens one context per radio
+    Stream_Manager(std::vector<Radio_Stream_Config> radios);
+
+    Stream_Manager(const Stream_Manager&) = delete;
+    Stream_Manager& operator =(const Stream_Manager&) = delete;
+
+    ~Stream_Manager() {
+        stop();
+    }
+
+    Context& context(size_t radio) {
+        return contexts.at(radio);
+    }
+
+    // Cancelling it, e.g. from a signal handler, stops every stream at once
+    Cancellation_Token& token() {
+        return cancel;
+    }
+
+    void start(Handler rx = nullptr, Handler tx = nullptr);
+
+    // Cancels the buffers in flight and joins the stream threads
+    void stop();
+
+    std::vector<Stream_Stats> stats() const;
+
+    // Sum over all streams, over the longest running one
+    Stream_Stats total() const;
+
+    // Gaps detected since the last call, up to Sample_Timeline::max_pending
+    std::vector<Stream_Gap> take_gaps() {
+        std::lock_guard<std::mutex> l(gaps_lock);
+        return std::exchange(gaps, {});
+    }
+};
+
+Stream_Manager::Stream_Manager(std::vector<Radio_Stream_Config> radios) : configs(std::move(radios)) {
+    contexts.reserve(configs.size());
+    for (auto& c : configs) {
+        contexts.emplace_back("uri", c.uri);
+        if (c.timeout.count() > 0) {
+            contexts.back().set_timeout(c.timeout);
+        }
+    }
+}
+
+void Stream_Manager::run(Stream* s, Handler handler) {
+    auto& config = configs[s->radio];
+    auto& realtime = s->output ? config.tx_realtime : config.rx_realtime;
+    s->realtime = apply_realtime(realtime);
+    try {
+        Device dev = contexts[s->radio].devices[s->output ? config.tx_device : config.rx_device];
+        auto& names = s->output ? config.tx_channels : config.rx_channels;
+        Stream_Layout layout = Stream_Layout::plan(dev, std::vector<std::string_view>(names.begin(), names.end()), s->output);
+        // Blocks the kernel can queue ahead, taken when the buffer is created
+        size_t queued = dev.kernel_buffers();
+        Buffer buffer(dev, config.samples);
+        Cancellation_Token::Attach attached(cancel, buffer);
+        if (realtime.prefault) {
+            s->realtime.prefaulted = buffer.prefault(realtime.lock_memory);
+        }
+
+        double rate = config.sample_rate;
+        if (rate <= 0) {
+            try {
+                rate = (double)layout.fields.at(0).channel.attributes[ad9361::sampling_frequency].value();
+            } catch (std::exception&) {
+                rate = 0;
+            }
+        }
+        Sample_Timeline timeline(rate, queued * config.samples, config.timestamp_period);
+        std::optional<Xflow_Monitor> xflow;
+        if (config.check_status) {
+            xflow.emplace(dev, s->output);
+        }
+
+        s->started.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_release);
+        while (running.load(std::memory_order_relaxed) && !cancel.cancelled()) {
+            if (s->output && handler) {
+                handler(s->radio, buffer, timeline.position());
+            }
+            ssize_t ret = s->output ? buffer.push() : buffer.refill();
+            if (ret < 0) {
+                throw std::system_error{(int)-ret, std::generic_category(), s->output ? "push error" : "refill error"};
+            }
+            if (xflow && xflow->check()) {
+                timeline.flag();
+            }
+            // Timestamps, with "timestamp" among the channels, replace the timing estimate
+            uint64_t index = buffer.timestamped() && !s->output
+                ? timeline.advance(config.samples, buffer.timestamps()[0])
+                : timeline.advance(config.samples);
+            auto found = timeline.take_gaps();
+            if (!found.empty()) {
+                std::lock_guard<std::mutex> l(gaps_lock);
+                for (auto& g : found) {
+                    s->gaps.fetch_add(1, std::memory_order_relaxed);
+                    s->lost.fetch_add(g.lost, std::memory_order_relaxed);
+                    if (gaps.size() < Sample_Timeline::max_pending) {
+                        gaps.push_back(Stream_Gap{s->radio, s->output, g});
+                    }
+                }
+            }
+            if (!s->output && handler) {
+                handler(s->radio, buffer, index);
+            }
+            s->buffers.fetch_add(1, std::memory_order_relaxed);
+            s->samples.fetch_add(config.samples, std::memory_order_relaxed);
+            s->bytes.fetch_add(config.samples * layout.sample_size, std::memory_order_relaxed);
+        }
+    } catch (std::exception& e) {
+        // Cancelled transfers end the stream, they are not errors
+        if (!cancel.cancelled()) {
+            s->error = e.what();
+        }
+    }
+    s->stopped = std::chrono::steady_clock::now();
+    if (s->started.load() == 0) {
+        s->started = s->stopped.time_since_epoch().count();
+    }
+}
+
+void Stream_Manager::start(Handler rx, Handler tx) {
+    if (running.exchange(true)) {
+        return;
+    }
+    cancel.reset();
+    streams.clear();
+    for (size_t i = 0; i < configs.size(); i++) {
+        for (bool output : {false, true}) {
+            if (!(output ? configs[i].tx : configs[i].rx)) {
+                continue;
+            }
+            auto s = std::make_unique<Stream>();
+            s->radio = i;
+            s->output = output;
+            s->thread = std::thread(&Stream_Manager::run, this, s.get(), output ? tx : rx);
+            streams.push_back(std::move(s));
+        }
+    }
+}
+
+void Stream_Manager::stop() {
+    running = false;
+    cancel.cancel();
+    for (auto& s : streams) {
+        if (s->thread.joinable()) {
+            s->thread.join();
+        }
+    }
+}
+
+std::vector<Stream_Stats> Stream_Manager::stats() const {
+    std::vector<Stream_Stats> r;
+    auto now = std::chrono::steady_clock::now();
+    for (auto& s : streams) {
+        // Running streams are measured up to now; error and stopped are only read once joined
+        bool joined = !s->thread.joinable();
+        auto rep = s->started.load(std::memory_order_acquire);
+        if (rep == 0) {
+            r.push_back(Stream_Stats{s->radio, s->output, -1, {}, 0, 0, 0, 0, {}, 0, 0});
+            continue;
+        }
+        std::chrono::steady_clock::time_point started{std::chrono::steady_clock::duration(rep)};
+        auto& realtime = s->output ? configs[s->radio].tx_realtime : configs[s->radio].rx_realtime;
+        auto end = joined ? s->stopped : now;
+        r.push_back(Stream_Stats{s->radio, s->output, s->realtime.affinity == 0 ? realtime.core : -1, s->realtime,
+                                 s->buffers.load(), s->samples.load(), s->bytes.load(),
+                                 std::chrono::duration<double>(end - started).count(),
+                                 joined ? s->error : std::string(), s->gaps.load(), s->lost.load()});
+    }
+    return r;
+}
+
+Stream_Stats Stream_Manager::total() const {
+    Stream_Stats t{0, false, -1, {}, 0, 0, 0, 0, {}, 0, 0};
+    for (auto& s : stats()) {
+        t.buffers += s.buffers;
+        t.samples += s.samples;
+        t.bytes += s.bytes;
+        t.gaps += s.gaps;
+        t.lost += s.lost;
+        t.seconds = std::max(t.seconds, s.seconds);
+        if (!s.error.empty()) {
+            t.error = s.error;
+        }
+    }
+    return t;
+}
@@ -0,0 +1,391 @@
+#pragma once
+
+#include "iioc++.h"
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+struct Supervisor_Config {
+    std::string uri;
+    std::chrono::milliseconds timeout{2000};    // context timeout, bounds how long a dead link blocks
+    std::chrono::milliseconds retry{200};       // pause between reconnect attempts
+    std::chrono::milliseconds wait{0};          // refill/push wait for a reconnect, zero waits forever
+};
+
+struct Outage {
+    std::string cause;              // operation whose error exposed the outage
+    int err;                        // its errno
+    std::chrono::steady_clock::time_point began;    // failure detected
+    std::chrono::steady_clock::time_point restored; // reconnected with the attribute state replayed
+    size_t attempts;                // connections tried
+    Profile_Report replay;          // attributes restored on the new context
+
+    double seconds() const {
+        return std::chrono::duration<double>(restored - began).count();
+    }
+};
+
+/*
+ * Context that survives a dropped network link. Errors such as ECONNRESET
+ * or ETIMEDOUT from refill(), push() and call() mark it down; a background
+ * thread reconnects, replays the attribute state applied so far on the new
+ * context, diffed so a device that kept its settings gets no writes, and
+ * swaps it in. Buffers keep their address: each is recreated with the same
+ * device, channels and size by its next refill() or push(), which waits for
+ * the reconnect. The old context lives on until no buffer refers to it.
+ * Every buffer must be used by one thread at a time.
+ */
+class Supervised_Context {
+    struct Buffer_Spec {
+        std::string device;
+        std::vector<std::string> channels;
+        bool output;
+        size_t samples;
+        bool cyclic;
+    };
+
+    struct Slot {
+        Buffer_Spec spec;
+        uint64_t generation;
+        Buffer buffer;
+    };
+
+    Supervisor_Config config;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::mutex applying;            // serializes apply(), held across its attribute I/O
+    std::shared_ptr<Context> ctx;   // shared with apply() and call() running unlocked
+    std::vector<std::shared_ptr<Context>> retired;  // replaced contexts still referred to by stale buffers
+    std::vector<std::unique_ptr<Slot>> slots;
+    Radio_Profile state;            // last applied attribute values, replayed on reconnect
+    uint64_t generation = 0;
+    bool up = true;
+    bool closing = false;
+    Outage current{};
+    std::vector<Outage> history;
+    std::thread thread;
+
+    std::shared_ptr<Context> connect();
+    Buffer create(Context& c, Buffer_Spec const& spec);
+    bool fail(int err, std::string cause, uint64_t seen);
+    bool wait_up(std::unique_lock<std::mutex>& l);
+    int renew(Slot& s);
+    void supervise();
+public:
+    // Errors meaning the link, not the request, failed
+    static bool link_error(int err) {
+        switch (err) {
+        case EPIPE: case ECONNRESET: case ECONNREFUSED: case ECONNABORTED: case ENOTCONN:
+        case ETIMEDOUT: case EHOSTUNREACH: case ENETUNREACH: case ENETDOWN: case ESHUTDOWN:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // Connects right away, throws like Context when it cannot
+    Supervised_Context(Supervisor_Config const& c);
+    ~Supervised_Context();
+
+    Supervised_Context(const Supervised_Context&) = delete;
+    Supervised_Context& operator =(const Supervised_Context&) = delete;
+
+    /*
+     * Applies a profile through Profile_Applier and records it as the state
+     * to replay; settings whose write failed are not recorded. The attribute
+     * I/O runs without the lock, so refill() and push() go on meanwhile; a
+     * reconnect during it applies the profile again on the new context.
+     */
+    Profile_Report apply(Radio_Profile const& profile);
+
+    Profile_Report set(std::string const& path, std::string value) {
+        return apply(Radio_Profile().set(path, std::move(value)));
+    }
+
+    /*
+     * Runs fn(Context&) on the current context, after a reconnect if one is
+     * under way, without the lock held. Handles obtained in fn must not
+     * outlive the call.
+     */
+    template <typename F>
+    auto call(F fn) -> decltype(fn(std::declval<Context&>()));
+
+    // Plans the channels with Stream_Layout and creates the buffer, returns its id
+    size_t add_buffer(std::string const& device, std::vector<std::string> const& channels,
+                      bool output = false, size_t samples = 1 << 16, bool cyclic = false);
+
+    // Valid for the life of this object, contents change on reconnect
+    Buffer& buffer(size_t id) {
+        std::lock_guard<std::mutex> l(lock);
+        return slots.at(id)->buffer;
+    }
+
+    // -ENOTCONN when the wait for a reconnect ran out, else like Buffer
+    ssize_t refill(size_t id);
+    ssize_t push(size_t id, size_t samples_count = 0);
+
+    // Reports an error from elsewhere; true when it marked the link down
+    bool report(int err, std::string cause) {
+        std::lock_guard<std::mutex> l(lock);
+        return fail(err, std::move(cause), generation);
+    }
+
+    bool connected() {
+        std::lock_guard<std::mutex> l(lock);
+        return up;
+    }
+
+    bool wait_connected(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> l(lock);
+        return changed.wait_for(l, timeout, [this]() { return up || closing; }) && up;
+    }
+
+    // Connections made so far, 0 for the first
+    uint64_t reconnects() {
+        std::lock_guard<std::mutex> l(lock);
+        return generation;
+    }
+
+    std::vector<Outage> outages() {
+        std::lock_guard<std::mutex> l(lock);
+        return history;
+    }
+};
+
+Supervised_Context::Supervised_Context(Supervisor_Config const& c) : config(c), ctx(connect()) {
+    thread = std::thread(&Supervised_Context::supervise, this);
+}
+
+Supervised_Context::~Supervised_Context() {
+    {
+        std::lock_guard<std::mutex> l(lock);
+        closing = true;
+    }
+    changed.notify_all();
+    thread.join();
+    // Buffers go before the contexts they were created on
+    slots.clear();
+}
+
+std::shared_ptr<Context> Supervised_Context::connect() {
+    auto c = std::make_shared<Context>("uri", config.uri);
+    if (config.timeout.count() > 0) {
+        c->set_timeout(config.timeout);
+    }
+    return c;
+}
+
+Buffer Supervised_Context::create(Context& c, Buffer_Spec const& spec) {
+    Device dev = c.devices[spec.device];
+    Stream_Layout::plan(dev, std::vector<std::string_view>(spec.channels.begin(), spec.channels.end()), spec.output);
+    return Buffer(dev, spec.samples, spec.cyclic);
+}
+
+// Called with the lock held; seen is the generation the failed call ran on
+bool Supervised_Context::fail(int err, std::string cause, uint64_t seen) {
+    if (!link_error(err) || !up || seen != generation || closing) {
+        return false;
+    }
+    up = false;
+    current = Outage{std::move(cause), err, std::chrono::steady_clock::now(), {}, 0, {}};
+    changed.notify_all();
+    return true;
+}
+
+// Called with the lock held; false when the wait ran out
+bool Supervised_Context::wait_up(std::unique_lock<std::mutex>& l) {
+    auto ready = [this]() { return up || closing; };
+    if (config.wait.count() > 0) {
+        changed.wait_for(l, config.wait, ready);
+    } else {
+        changed.wait(l, ready);
+    }
+    return up;
+}
+
+void Supervised_Context::supervise() {
+    std::unique_lock<std::mutex> l(lock);
+    for (;;) {
+        changed.wait(l, [this]() { return !up || closing; });
+        if (closing) {
+            return;
+        }
+        Radio_Profile replay = state;
+        l.unlock();
+
+        // Connect and restore outside the lock, the old context stays in place meanwhile
+        std::shared_ptr<Context> fresh;
+        Profile_Report restored{};
+        size_t attempts = 0;
+        for (;;) {
+            attempts++;
+            try {
+                fresh = connect();
+                restored = Profile_Applier(*fresh).apply(replay);
+                break;
+            } catch (std::system_error&) {
+                fresh.reset();
+            }
+            l.lock();
+            bool stop = changed.wait_for(l, config.retry, [this]() { return closing; });
+            l.unlock();
+            if (stop) {
+                return;
+            }
+        }
+
+        l.lock();
+        retired.push_back(std::move(ctx));
+        ctx = std::move(fresh);
+        generation++;
+        current.restored = std::chrono::steady_clock::now();
+        current.attempts = attempts;
+        current.replay = std::move(restored);
+        history.push_back(std::move(current));
+        up = true;
+        if (slots.empty()) {
+            retired.clear();
+        }
+        changed.notify_all();
+    }
+}
+
+Profile_Report Supervised_Context::apply(Radio_Profile const& profile) {
+    std::lock_guard<std::mutex> serial(applying);
+    for (;;) {
+        std::unique_lock<std::mutex> l(lock);
+        if (!wait_up(l)) {
+            throw std::system_error{ENOTCONN, std::generic_category(), "context not reconnected"};
+        }
+        uint64_t seen = generation;
+        std::shared_ptr<Context> c = ctx;
+        l.unlock();
+
+        Profile_Report report{};
+        try {
+            report = Profile_Applier(*c).apply(profile);
+        } catch (std::system_error& e) {
+            l.lock();
+            fail(e.code().value(), "apply", seen);
+            throw;
+        }
+
+        l.lock();
+        if (generation != seen) {
+            // Written to the replaced context after the replay was taken
+            continue;
+        }
+        for (auto& r : report.results) {
+            if (!r.ok()) {
+                fail(-r.err, std::string("write ") + r.key, seen);
+            }
+        }
+        for (auto& s : profile.settings) {
+            std::string path = s.path();
+            if (std::find(report.failed.begin(), report.failed.end(), path) == report.failed.end()) {
+                state.set(path, s.value);
+            }
+        }
+        return report;
+    }
+}
+
+template <typename F>
+auto Supervised_Context::call(F fn) -> decltype(fn(std::declval<Context&>())) {
+    std::unique_lock<std::mutex> l(lock);
+    if (!wait_up(l)) {
+        throw std::system_error{ENOTCONN, std::generic_category(), "context not reconnected"};
+    }
+    uint64_t seen = generation;
+    std::shared_ptr<Context> c = ctx;
+    l.unlock();
+    try {
+        return fn(*c);
+    } catch (std::system_error& e) {
+        l.lock();
+        fail(e.code().value(), e.what(), seen);
+        throw;
+    }
+}
+
+size_t Supervised_Context::add_buffer(std::string const& device, std::vector<std::string> const& channels,
+                                      bool output, size_t samples, bool cyclic)
+{
+    std::unique_lock<std::mutex> l(lock);
+    if (!wait_up(l)) {
+        throw std::system_error{ENOTCONN, std::generic_category(), "context not reconnected"};
+    }
+    Buffer_Spec spec{device, channels, output, samples, cyclic};
+    Buffer buffer = create(*ctx, spec);
+    slots.push_back(std::make_unique<Slot>(Slot{std::move(spec), generation, std::move(buffer)}));
+    return slots.size() - 1;
+}
+
+/*
+ * Called with the lock held while up. Recreates a buffer left over from a
+ * replaced context, keeping the samples queued in an output buffer, and
+ * drops the old contexts once no buffer refers to them.
+ */
+int Supervised_Context::renew(Slot& s) {
+    if (s.generation == generation) {
+        return 0;
+    }
+    std::vector<std::complex<int16_t>> queued;
+    if (s.spec.output) {
+        queued.assign(s.buffer.begin(), s.buffer.end());
+    }
+    s.buffer.destroy();
+    try {
+        s.buffer = create(*ctx, s.spec);
+    } catch (std::system_error& e) {
+        fail(e.code().value(), "buffer not recreated", generation);
+        return -e.code().value();
+    }
+    std::copy_n(queued.begin(), std::min(queued.size(), s.spec.samples), s.buffer.begin());
+    s.generation = generation;
+    if (std::all_of(slots.begin(), slots.end(), [this](auto& x) { return x->generation == generation; })) {
+        retired.clear();
+    }
+    return 0;
+}
+
+ssize_t Supervised_Context::refill(size_t id) {
+    std::unique_lock<std::mutex> l(lock);
+    if (!wait_up(l)) {
+        return -ENOTCONN;
+    }
+    Slot& s = *slots.at(id);
+    if (int err = renew(s)) {
+        return err;
+    }
+    uint64_t seen = s.generation;
+    l.unlock();
+
+    ssize_t ret = s.buffer.refill();
+    if (ret < 0) {
+        l.lock();
+        fail((int)-ret, "refill", seen);
+    }
+    return ret;
+}
+
+ssize_t Supervised_Context::push(size_t id, size_t samples_count) {
+    std::unique_lock<std::mutex> l(lock);
+    if (!wait_up(l)) {
+        return -ENOTCONN;
+    }
+    Slot& s = *slots.at(id);
+    if (int err = renew(s)) {
+        return err;
+    }
+    uint64_t seen = s.generation;
+    l.unlock();
+
+    ssize_t ret = s.buffer.push(samples_count);
+    if (ret < 0) {
+        l.lock();
+        fail((int)-ret, "push", seen);
+    }
+    return ret;
+}
@@ -0,0 +1,310 @@
+#pragma once
+
+#include "iioc++.h"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+/*
+ * In-place radix-2 FFT with twiddles and bit reversal precomputed for one
+ * power-of-two size.
+ */
+class Fft {
+    size_t n;
+    std::vector<std::complex<float>> twiddle;
+    std::vector<size_t> reversed;
+public:
+    Fft(size_t size);
+
+    size_t size() const {
+        return n;
+    }
+
+    void operator()(std::complex<float>* x) const;
+};
+
+Fft::Fft(size_t size) : n(size), twiddle(size / 2), reversed(size) {
+    if (size < 2 || (size & (size - 1)) != 0) {
+        throw std::system_error{EINVAL, std::generic_category(), "fft size is not a power of two"};
+    }
+    for (size_t i = 0; i < n / 2; i++) {
+        twiddle[i] = std::polar(1.0f, (float)(-2 * M_PI * i / n));
+    }
+    int bits = 0;
+    while ((size_t(1) << bits) < n) {
+        bits++;
+    }
+    for (size_t i = 0; i < n; i++) {
+        size_t r = 0;
+        for (int b = 0; b < bits; b++) {
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+        reversed[i] = r;
+    }
+}
+
+void Fft::operator()(std::complex<float>* x) const {
+    for (size_t i = 0; i < n; i++) {
+        if (i < reversed[i]) {
+            std::swap(x[i], x[reversed[i]]);
+        }
+    }
+    for (size_t len = 2; len <= n; len *= 2) {
+        size_t stride = n / len;
+        for (size_t i = 0; i < n; i += len) {
+            for (size_t k = 0; k < len / 2; k++) {
+                std::complex<float> t = twiddle[k * stride] * x[i + k + len / 2];
+                x[i + k + len / 2] = x[i + k] - t;
+                x[i + k] += t;
+            }
+        }
+    }
+}
+
+struct Sweep_Config {
+    long long start;                // first centre frequency, Hz
+    long long stop;                 // last centre frequency at most, Hz
+    long long sample_rate;          // complex samples per second, as configured on the phy
+    double usable = 0.75;           // centre fraction of each spectrum kept, the rest is roll-off
+    size_t fft_size = 1024;
+    size_t averages = 8;            // FFTs averaged per step
+    std::chrono::microseconds settle{200};  // after a retune, discarded from the capture
+    double full_scale = 2048;       // 12-bit ADC samples
+    bool pipelined = true;          // process step N while retuning to N + 1
+};
+
+struct Sweep_Result {
+    long long start;                // frequency of the first bin, Hz
+    double bin_width;               // Hz
+    std::vector<float> power;       // dBFS per bin, all steps stitched
+    size_t steps;
+    double seconds;                 // whole sweep
+    double capture_seconds;         // retuning and capturing, summed over steps
+    double process_seconds;         // FFTs, summed over steps
+
+    double span() const {
+        return power.size() * bin_width;
+    }
+
+    // Headline metric: swept bandwidth per second of wall time
+    double rate() const {
+        return span() / 1e6 / seconds;
+    }
+};
+
+/*
+ * Wideband spectrum sweep by retuning an ad9361-phy LO. The capture thread
+ * retunes, refills and copies samples out of the buffer; a worker thread
+ * computes the averaged spectrum of the previous step meanwhile. Settling
+ * samples after each retune are dropped, and the centre of every spectrum
+ * is stitched into one result.
+ */
+class Sweep_Engine {
+    struct Block {
+        size_t step;
+        std::vector<std::complex<float>> samples;
+    };
+
+    iio_channel* lo;
+    iio_device* rx;
+    Sweep_Config config;
+    Fft fft;
+    std::vector<float> window;
+    size_t kept;                    // bins kept per step
+    size_t settle_samples;
+
+    void process(Block& block, Sweep_Result& result, std::vector<std::complex<float>>& scratch,
+                 std::vector<float>& power) const;
+public:
+    /*
+     * lo is altvoltage0 (RX_LO) of ad9361-phy, rx the capture device
+     * (cf-ad9361-lpc) with its I and Q channels enabled.
+     */
+    Sweep_Engine(Channel const& lo_channel, Device const& rx_device, Sweep_Config const& sweep);
+
+    size_t steps() const;
+
+    Sweep_Result run();
+};
+
+Sweep_Engine::Sweep_Engine(Channel const& lo_channel, Device const& rx_device, Sweep_Config const& sweep)
+    : lo(lo_channel.a), rx(rx_device.dev), config(sweep), fft(sweep.fft_size), window(sweep.fft_size)
+{
+    if (config.sample_rate <= 0 || config.stop < config.start || config.averages == 0
+            || config.usable <= 0 || config.usable > 1) {
+        throw std::system_error{EINVAL, std::generic_category(), "bad sweep config"};
+    }
+    // Hann window, normalized so a full-scale tone reads 0 dBFS
+    double sum = 0;
+    for (size_t i = 0; i < window.size(); i++) {
+        window[i] = 0.5f - 0.5f * std::cos(2 * M_PI * i / window.size());
+        sum += window[i];
+    }
+    for (auto& w : window) {
+        w /= sum * config.full_scale;
+    }
+    kept = std::max<size_t>(2, (size_t)(config.fft_size * config.usable) & ~size_t(1));
+    settle_samples = (size_t)(config.settle.count() * 1e-6 * config.sample_rate);
+}
+
+size_t Sweep_Engine::steps() const {
+    double step_hz = kept * (double)config.sample_rate / config.fft_size;
+    return (size_t)((config.stop - config.start) / step_hz) + 1;
+}
+
+void Sweep_Engine::process(Block& block, Sweep_Result& result, std::vector<std::complex<float>>& scratch,
+                           std::vector<float>& power) const
+{
+    size_t n = config.fft_size;
+    std::fill(power.begin(), power.end(), 0.0f);
+    for (size_t a = 0; a < config.averages; a++) {
+        const std::complex<float>* in = &block.samples[a * n];
+        for (size_t i = 0; i < n; i++) {
+            scratch[i] = in[i] * window[i];
+        }
+        fft(scratch.data());
+        for (size_t i = 0; i < n; i++) {
+            power[i] += std::norm(scratch[i]);
+        }
+    }
+    // Centre bins in frequency order: negative half of the FFT first
+    float* out = &result.power[block.step * kept];
+    for (size_t k = 0; k < kept; k++) {
+        size_t bin = (n - kept / 2 + k) % n;
+        out[k] = 10 * std::log10(power[bin] / config.averages + 1e-20f);
+    }
+}
+
+Sweep_Result Sweep_Engine::run() {
+    using clock = std::chrono::steady_clock;
+    size_t n = config.fft_size * config.averages;
+    size_t count = steps();
+    double bin_width = (double)config.sample_rate / config.fft_size;
+
+    Sweep_Result result{};
+    result.bin_width = bin_width;
+    result.start = config.start - (long long)(kept / 2 * bin_width);
+    result.steps = count;
+    result.power.resize(count * kept);
+
+    // One block in flight while the next is captured
+    Block blocks[2] = {{0, std::vector<std::complex<float>>(n)}, {0, std::vector<std::complex<float>>(n)}};
+    Block* ready = nullptr;
+    bool free[2] = {true, true};
+    bool done = false;
+    std::mutex lock;
+    std::condition_variable changed;
+    double process_seconds = 0;
+
+    auto worker = [&]() {
+        std::vector<std::complex<float>> scratch(config.fft_size);
+        std::vector<float> power(config.fft_size);
+        for (;;) {
+            Block* block;
+            {
+                std::unique_lock<std::mutex> l(lock);
+                changed.wait(l, [&]() { return ready != nullptr || done; });
+                if (ready == nullptr) {
+                    return;
+                }
+                block = ready;
+                ready = nullptr;
+            }
+            changed.notify_all();
+            auto start = clock::now();
+            process(*block, result, scratch, power);
+            {
+                std::lock_guard<std::mutex> l(lock);
+                process_seconds += std::chrono::duration<double>(clock::now() - start).count();
+                free[block - blocks] = true;
+            }
+            changed.notify_all();
+        }
+    };
+
+    // Fewer kernel buffers leave fewer blocks captured before the retune. The
+    // count is taken when a buffer is created, so it is put back right after.
+    Device dev(rx);
+    unsigned int kernel_buffers = dev.kernel_buffers();
+    dev.set_kernel_buffers(1);
+    Buffer buffer = [&]() {
+        try {
+            Buffer b(dev, settle_samples + n);
+            dev.set_kernel_buffers(kernel_buffers);
+            return b;
+        } catch (...) {
+            try {
+                dev.set_kernel_buffers(kernel_buffers);
+            } catch (std::system_error&) {
+            }
+            throw;
+        }
+    }();
+    std::vector<std::complex<float>> scratch(config.fft_size);
+    std::vector<float> power(config.fft_size);
+    std::thread thread;
+    if (config.pipelined) {
+        thread = std::thread(worker);
+    }
+
+    auto sweep_start = clock::now();
+    try {
+        for (size_t step = 0; step < count; step++) {
+            auto start = clock::now();
+            long long centre = config.start + (long long)(step * kept * bin_width);
+            Typed_Channel_Attribute<long long>(lo, ad9361::frequency.key) = centre;
+            ssize_t ret = buffer.refill();
+            if (ret < 0) {
+                throw std::system_error{(int)-ret, std::generic_category(), "sweep refill error"};
+            }
+
+            Block* block;
+            {
+                std::unique_lock<std::mutex> l(lock);
+                changed.wait(l, [&]() { return free[0] || free[1]; });
+                block = &blocks[free[0] ? 0 : 1];
+                free[block - blocks] = false;
+            }
+            // Buffer keeps voltage1 (Q) in real() and voltage0 (I) in imag()
+            auto in = buffer.begin() + settle_samples;
+            for (size_t i = 0; i < n; i++, ++in) {
+                block->samples[i] = std::complex<float>(in->imag(), in->real());
+            }
+            block->step = step;
+            result.capture_seconds += std::chrono::duration<double>(clock::now() - start).count();
+
+            if (config.pipelined) {
+                std::unique_lock<std::mutex> l(lock);
+                changed.wait(l, [&]() { return ready == nullptr; });
+                ready = block;
+                changed.notify_all();
+            } else {
+                start = clock::now();
+                process(*block, result, scratch, power);
+                process_seconds += std::chrono::duration<double>(clock::now() - start).count();
+                free[block - blocks] = true;
+            }
+        }
+    } catch (...) {
+        if (thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> l(lock);
+                done = true;
+            }
+            changed.notify_all();
+            thread.join();
+        }
+        throw;
+    }
+    if (thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            done = true;
+        }
+        changed.notify_all();
+        thread.join();
+    }
+    result.seconds = std::chrono::duration<double>(clock::now() - sweep_start).count();
+    result.process_seconds = process_seconds;
+    return result;
+}
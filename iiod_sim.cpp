@@ -0,0 +1,915 @@
+/*
+ * iiod-sim - local stand-in for iiod serving a simulated AD9361
+ *
+ * Speaks the subset of the iiod text protocol used by the libiio network
+ * backend (VERSION, PRINT, READ, WRITE, OPEN, CLOSE, READBUF, WRITEBUF,
+ * TIMEOUT, GETTRIG, SETTRIG, SET, EXIT) so the network code path can be
+ * benchmarked on localhost:
+ *
+ *     iiod-sim -p 30431 -l 200 -b 12500000
+ *     Context ctx("network", "127.0.0.1");
+ *
+ * Latency (-l) is added before every reply, bandwidth (-b) throttles every
+ * byte sent back to the client and -r models the synthesizer calibration
+ * time of an LO frequency write. -d resets every client connection
+ * periodically, as a dropped link would, to exercise reconnection.
+ **/
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct Options {
+    int port = 30431;
+    long latency_us = 0;
+    double bandwidth = 0;       // bytes per second, 0 = unlimited
+    long retune_us = 0;         // cost of a plain LO frequency write
+    long recall_us = 0;         // cost of a fastlock profile recall
+    double tone_hz = 2.41e9;    // RF frequency of the simulated carrier
+    bool pace = false;          // deliver samples at sampling_frequency
+    double drop_s = 0;          // drop every client connection this often, 0 never
+    long outage_ms = 500;       // connections refused after a drop
+};
+
+Options opt;
+
+struct Sim_Channel {
+    std::string id;
+    std::string name;
+    bool output;
+    int scan_index;             // -1 for non scan elements
+    std::string format;
+    std::vector<std::string> attrs;
+};
+
+struct Sim_Device {
+    std::string id;
+    std::string name;
+    std::vector<Sim_Channel> channels;
+    std::vector<std::string> attrs;
+    std::vector<std::string> buffer_attrs;
+};
+
+std::vector<Sim_Device> devices;
+std::map<std::string, std::string> values;
+long long fastlock_slots[2][8];
+std::mutex state_lock;
+
+/* Open client sockets, so a simulated link drop can shut them down */
+std::vector<int> clients;
+std::chrono::steady_clock::time_point refuse_until;
+std::mutex clients_lock;
+
+const std::vector<std::string> phy_rx_attrs = {
+    "gain_control_mode", "gain_control_mode_available", "hardwaregain",
+    "hardwaregain_available", "rf_bandwidth", "rf_bandwidth_available",
+    "rf_port_select", "rf_port_select_available", "rssi",
+    "sampling_frequency", "sampling_frequency_available",
+};
+
+const std::vector<std::string> phy_tx_attrs = {
+    "hardwaregain", "hardwaregain_available", "rf_bandwidth",
+    "rf_bandwidth_available", "rf_port_select", "rf_port_select_available",
+    "rssi", "sampling_frequency", "sampling_frequency_available",
+};
+
+const std::vector<std::string> lo_attrs = {
+    "external", "fastlock_load", "fastlock_recall", "fastlock_save",
+    "fastlock_store", "frequency", "frequency_available", "powerdown",
+};
+
+void build_devices() {
+    Sim_Device phy{"iio:device0", "ad9361-phy", {}, {
+        "calib_mode", "calib_mode_available", "dcxo_tune_coarse",
+        "ensm_mode", "ensm_mode_available", "filter_fir_config",
+        "trx_rate_governor", "xo_correction",
+    }, {}};
+    phy.channels.push_back({"voltage0", "", false, -1, "", phy_rx_attrs});
+    phy.channels.push_back({"voltage0", "", true, -1, "", phy_tx_attrs});
+    phy.channels.push_back({"altvoltage0", "RX_LO", true, -1, "", lo_attrs});
+    phy.channels.push_back({"altvoltage1", "TX_LO", true, -1, "", lo_attrs});
+    phy.channels.push_back({"temp0", "", false, -1, "", {"input"}});
+    devices.push_back(phy);
+
+    Sim_Device tx{"iio:device1", "cf-ad9361-dds-core-lpc", {}, {}, {"length"}};
+    tx.channels.push_back({"voltage0", "", true, 0, "le:S16/16>>0", {"calibphase", "calibscale", "sampling_frequency"}});
+    tx.channels.push_back({"voltage1", "", true, 1, "le:S16/16>>0", {"calibphase", "calibscale", "sampling_frequency"}});
+    devices.push_back(tx);
+
+    Sim_Device rx{"iio:device2", "cf-ad9361-lpc", {}, {}, {"length"}};
+    rx.channels.push_back({"voltage0", "", false, 0, "le:S12/16>>0", {"calibbias", "calibphase", "calibscale", "sampling_frequency"}});
+    rx.channels.push_back({"voltage1", "", false, 1, "le:S12/16>>0", {"calibbias", "calibphase", "calibscale", "sampling_frequency"}});
+    devices.push_back(rx);
+
+    values = {
+        {"iio:device0//calib_mode", "auto"},
+        {"iio:device0//calib_mode_available", "auto manual manual_tx_quad tx_quad rf_dc_offs rssi_gain_step"},
+        {"iio:device0//dcxo_tune_coarse", "8"},
+        {"iio:device0//ensm_mode", "fdd"},
+        {"iio:device0//ensm_mode_available", "sleep wait alert fdd pinctrl pinctrl_fdd_indep"},
+        {"iio:device0//trx_rate_governor", "nominal"},
+        {"iio:device0//xo_correction", "40000000"},
+        {"iio:device0/in/voltage0/gain_control_mode", "slow_attack"},
+        {"iio:device0/in/voltage0/gain_control_mode_available", "manual fast_attack slow_attack hybrid"},
+        {"iio:device0/in/voltage0/hardwaregain", "71.000000 dB"},
+        {"iio:device0/in/voltage0/hardwaregain_available", "[-3 1 71]"},
+        {"iio:device0/in/voltage0/rf_bandwidth", "18000000"},
+        {"iio:device0/in/voltage0/rf_bandwidth_available", "[200000 1 56000000]"},
+        {"iio:device0/in/voltage0/rf_port_select", "A_BALANCED"},
+        {"iio:device0/in/voltage0/rf_port_select_available", "A_BALANCED B_BALANCED C_BALANCED A_N A_P B_N B_P C_N C_P TX_MONITOR1 TX_MONITOR2 TX_MONITOR1_2"},
+        {"iio:device0/in/voltage0/rssi", "112.25 dB"},
+        {"iio:device0/in/voltage0/sampling_frequency", "30720000"},
+        {"iio:device0/in/voltage0/sampling_frequency_available", "[2083333 1 61440000]"},
+        {"iio:device0/out/voltage0/hardwaregain", "-10.000000 dB"},
+        {"iio:device0/out/voltage0/hardwaregain_available", "[0 250 89750]"},
+        {"iio:device0/out/voltage0/rf_bandwidth", "18000000"},
+        {"iio:device0/out/voltage0/rf_bandwidth_available", "[200000 1 40000000]"},
+        {"iio:device0/out/voltage0/rf_port_select", "A"},
+        {"iio:device0/out/voltage0/rf_port_select_available", "A B"},
+        {"iio:device0/out/voltage0/rssi", "0.00 dB"},
+        {"iio:device0/out/voltage0/sampling_frequency", "30720000"},
+        {"iio:device0/out/voltage0/sampling_frequency_available", "[2083333 1 61440000]"},
+        {"iio:device0/out/altvoltage0/frequency", "2400000000"},
+        {"iio:device0/out/altvoltage0/frequency_available", "[70000000 1 6000000000]"},
+        {"iio:device0/out/altvoltage0/external", "0"},
+        {"iio:device0/out/altvoltage0/powerdown", "0"},
+        {"iio:device0/out/altvoltage0/fastlock_recall", "0"},
+        {"iio:device0/out/altvoltage0/fastlock_store", "0"},
+        {"iio:device0/out/altvoltage0/fastlock_save", "0"},
+        {"iio:device0/out/altvoltage1/frequency", "2450000000"},
+        {"iio:device0/out/altvoltage1/frequency_available", "[46875001 1 6000000000]"},
+        {"iio:device0/out/altvoltage1/external", "0"},
+        {"iio:device0/out/altvoltage1/powerdown", "0"},
+        {"iio:device0/out/altvoltage1/fastlock_recall", "0"},
+        {"iio:device0/out/altvoltage1/fastlock_store", "0"},
+        {"iio:device0/out/altvoltage1/fastlock_save", "0"},
+        {"iio:device0/in/temp0/input", "34532"},
+        {"iio:device1//length", "0"},
+        {"iio:device2//length", "0"},
+    };
+
+    std::string fir = "RX 3 GAIN -6 DEC 4\nTX 3 GAIN 0 INT 4\n";
+    for (int i = 0; i < 128; i++) {
+        fir += std::to_string(i * 13 - 800) + "," + std::to_string(i * 11 - 700) + "\n";
+    }
+    values["iio:device0//filter_fir_config"] = fir;
+
+    for (auto& d : devices) {
+        for (auto& c : d.channels) {
+            if (c.scan_index < 0) {
+                continue;
+            }
+            std::string prefix = d.id + (c.output ? "/out/" : "/in/") + c.id + "/";
+            values[prefix + "calibbias"] = "0";
+            values[prefix + "calibphase"] = "0.000000";
+            values[prefix + "calibscale"] = "1.000000";
+            values[prefix + "sampling_frequency"] = "30720000";
+        }
+    }
+}
+
+std::string xml_escape(std::string const& s) {
+    std::string r;
+    for (char c : s) {
+        switch (c) {
+        case '<': r += "&lt;"; break;
+        case '>': r += "&gt;"; break;
+        case '&': r += "&amp;"; break;
+        case '"': r += "&quot;"; break;
+        default: r += c;
+        }
+    }
+    return r;
+}
+
+std::string context_xml() {
+    std::string x = "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+        "<context name=\"network\" description=\"iiod-sim simulated AD9361\" >"
+        "<context-attribute name=\"hw_model\" value=\"iiod-sim AD9361\" />"
+        "<context-attribute name=\"fw_version\" value=\"v0.38-sim\" />"
+        "<context-attribute name=\"ad9361-phy,model\" value=\"ad9364\" />";
+    for (auto& d : devices) {
+        x += "<device id=\"" + d.id + "\" name=\"" + d.name + "\" >";
+        for (auto& c : d.channels) {
+            x += "<channel id=\"" + c.id + "\"";
+            if (!c.name.empty()) {
+                x += " name=\"" + c.name + "\"";
+            }
+            x += std::string(" type=\"") + (c.output ? "output" : "input") + "\" >";
+            if (c.scan_index >= 0) {
+                x += "<scan-element index=\"" + std::to_string(c.scan_index)
+                    + "\" format=\"" + xml_escape(c.format) + "\" scale=\"1.000000\" />";
+            }
+            for (auto& a : c.attrs) {
+                x += "<attribute name=\"" + a + "\" filename=\""
+                    + (c.output ? "out_" : "in_") + c.id + "_" + a + "\" />";
+            }
+            x += "</channel>";
+        }
+        for (auto& a : d.attrs) {
+            x += "<attribute name=\"" + a + "\" />";
+        }
+        for (auto& a : d.buffer_attrs) {
+            x += "<buffer-attribute name=\"" + a + "\" />";
+        }
+        x += "</device>";
+    }
+    return x + "</context>";
+}
+
+Sim_Device* find_device(std::string const& id) {
+    for (auto& d : devices) {
+        if (d.id == id || d.name == id) {
+            return &d;
+        }
+    }
+    return nullptr;
+}
+
+Sim_Channel* find_channel(Sim_Device* dev, std::string const& id, bool output) {
+    for (auto& c : dev->channels) {
+        if (c.output == output && (c.id == id || c.name == id)) {
+            return &c;
+        }
+    }
+    return nullptr;
+}
+
+std::string value_key(Sim_Device* dev, Sim_Channel* chn, std::string const& attr) {
+    if (chn == nullptr) {
+        return dev->id + "//" + attr;
+    }
+    return dev->id + (chn->output ? "/out/" : "/in/") + chn->id + "/" + attr;
+}
+
+/* Client input is untrusted: a malformed number becomes an error reply,
+ * never an exception escaping a connection thread. */
+bool parse_int(std::string const& s, long long* out, int base = 10) {
+    const char* p = s.c_str();
+    char* end;
+    errno = 0;
+    long long v = strtoll(p, &end, base);
+    if (end == p || *end != '\0' || errno == ERANGE) {
+        return false;
+    }
+    *out = v;
+    return true;
+}
+
+bool parse_size(std::string const& s, size_t* out) {
+    long long v;
+    if (!parse_int(s, &v) || v < 0) {
+        return false;
+    }
+    *out = (size_t)v;
+    return true;
+}
+
+bool parse_slot(std::string const& s, int* slot) {
+    long long v;
+    if (!parse_int(s, &v) || v < 0 || v > 7) {
+        return false;
+    }
+    *slot = (int)v;
+    return true;
+}
+
+long long lo_frequency(int lo) {
+    long long freq = 0;
+    parse_int(values["iio:device0/out/altvoltage" + std::to_string(lo) + "/frequency"], &freq);
+    return freq;
+}
+
+/* Fastlock profiles are opaque to clients; encode the LO frequency in the
+ * 16 register bytes the real driver reports. */
+std::string fastlock_encode(int slot, long long freq) {
+    std::string s = std::to_string(slot) + " ";
+    for (int i = 0; i < 16; i++) {
+        s += std::to_string(i < 8 ? (unsigned)((freq >> (8 * i)) & 0xff) : 0u);
+        s += i < 15 ? "," : "";
+    }
+    return s;
+}
+
+bool fastlock_decode(std::string const& s, int* slot, long long* freq) {
+    const char* p = s.c_str();
+    char* end;
+    *slot = strtol(p, &end, 10);
+    if (end == p || *slot < 0 || *slot > 7) {
+        return false;
+    }
+    *freq = 0;
+    for (int i = 0; i < 8; i++) {
+        p = end + 1;
+        long b = strtol(p, &end, 10);
+        if (end == p) {
+            return false;
+        }
+        *freq |= (long long)(b & 0xff) << (8 * i);
+    }
+    return true;
+}
+
+int read_attr(Sim_Device* dev, Sim_Channel* chn, std::string const& attr, std::string* out) {
+    auto& attrs = chn ? chn->attrs : dev->attrs;
+    if (std::find(attrs.begin(), attrs.end(), attr) == attrs.end()) {
+        return -ENOENT;
+    }
+    std::lock_guard<std::mutex> l(state_lock);
+    if (chn && attr == "fastlock_save") {
+        int lo = chn->id == "altvoltage1";
+        /* Like the driver: the slot last written to fastlock_save */
+        int slot = 0;
+        parse_slot(values[value_key(dev, chn, "fastlock_save")], &slot);
+        *out = fastlock_encode(slot, fastlock_slots[lo][slot]);
+        return 0;
+    }
+    if (chn && attr == "fastlock_load") {
+        return -EACCES;
+    }
+    *out = values[value_key(dev, chn, attr)];
+    return 0;
+}
+
+int write_attr(Sim_Device* dev, Sim_Channel* chn, std::string const& attr, std::string val) {
+    auto& attrs = chn ? chn->attrs : dev->attrs;
+    if (std::find(attrs.begin(), attrs.end(), attr) == attrs.end()) {
+        return -ENOENT;
+    }
+    while (!val.empty() && (val.back() == '\0' || val.back() == '\n' || val.back() == ' ')) {
+        val.pop_back();
+    }
+    if (attr == "rssi" || attr == "input"
+            || (attr.size() > 10 && attr.compare(attr.size() - 10, 10, "_available") == 0)) {
+        return -EACCES;
+    }
+
+    long delay_us = 0;
+    {
+        std::lock_guard<std::mutex> l(state_lock);
+        bool is_lo = chn && chn->id.compare(0, 10, "altvoltage") == 0;
+        int lo = chn && chn->id == "altvoltage1";
+        int slot;
+        long long number;
+        if ((is_lo && attr == "frequency") || attr == "sampling_frequency") {
+            if (!parse_int(val, &number) || number < 0) {
+                return -EINVAL;
+            }
+            delay_us = is_lo ? opt.retune_us : 0;
+        } else if (is_lo && attr == "fastlock_store") {
+            if (!parse_slot(val, &slot)) {
+                return -EINVAL;
+            }
+            fastlock_slots[lo][slot] = lo_frequency(lo);
+        } else if (is_lo && attr == "fastlock_save") {
+            if (!parse_slot(val, &slot)) {
+                return -EINVAL;
+            }
+        } else if (is_lo && attr == "fastlock_recall") {
+            if (!parse_slot(val, &slot) || fastlock_slots[lo][slot] == 0) {
+                return -EINVAL;
+            }
+            values[value_key(dev, chn, "frequency")] = std::to_string(fastlock_slots[lo][slot]);
+            delay_us = opt.recall_us;
+        } else if (is_lo && attr == "fastlock_load") {
+            long long freq;
+            if (!fastlock_decode(val, &slot, &freq)) {
+                return -EINVAL;
+            }
+            fastlock_slots[lo][slot] = freq;
+            return 0;
+        }
+        values[value_key(dev, chn, attr)] = val;
+        /* Both directions of the phy share one sample clock */
+        if (dev->name == "ad9361-phy" && chn && chn->id == "voltage0" && attr == "sampling_frequency") {
+            values["iio:device0/in/voltage0/sampling_frequency"] = val;
+            values["iio:device0/out/voltage0/sampling_frequency"] = val;
+        }
+    }
+    if (delay_us) {
+        std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+    }
+    return 0;
+}
+
+class Connection {
+    int fd;
+    std::string in;
+    std::vector<char> rx;
+    std::chrono::steady_clock::time_point sent_until;
+
+    struct Open_Buffer {
+        Sim_Device* dev = nullptr;
+        std::vector<Sim_Channel*> channels;
+        size_t samples = 0;
+        std::chrono::steady_clock::time_point next;
+    } buffer;
+    double phase = 0;
+    uint32_t noise = 12345;
+
+public:
+    Connection(int f) : fd(f), sent_until(std::chrono::steady_clock::now()) {
+        std::lock_guard<std::mutex> l(clients_lock);
+        clients.push_back(fd);
+    }
+
+    ~Connection() {
+        std::lock_guard<std::mutex> l(clients_lock);
+        clients.erase(std::find(clients.begin(), clients.end(), fd));
+        close(fd);
+    }
+
+    bool fill() {
+        char tmp[65536];
+        ssize_t ret = recv(fd, tmp, sizeof(tmp), 0);
+        if (ret <= 0) {
+            return false;
+        }
+        in.append(tmp, ret);
+        return true;
+    }
+
+    bool read_line(std::string* line) {
+        size_t pos;
+        while ((pos = in.find('\n')) == std::string::npos) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        *line = in.substr(0, pos);
+        in.erase(0, pos + 1);
+        if (!line->empty() && line->back() == '\r') {
+            line->pop_back();
+        }
+        return true;
+    }
+
+    bool read_bytes(std::string* dst, size_t len) {
+        while (in.size() < len) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        dst->assign(in, 0, len);
+        in.erase(0, len);
+        return true;
+    }
+
+    /* Every reply goes through here, so latency and bandwidth limits
+     * apply uniformly to control and streaming traffic. */
+    bool send_all(const char* p, size_t len, bool first = true) {
+        if (first && opt.latency_us) {
+            std::this_thread::sleep_for(std::chrono::microseconds(opt.latency_us));
+        }
+        while (len) {
+            size_t chunk = std::min<size_t>(len, 65536);
+            if (opt.bandwidth > 0) {
+                auto now = std::chrono::steady_clock::now();
+                if (sent_until < now) {
+                    sent_until = now;
+                }
+                sent_until += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(chunk / opt.bandwidth));
+                std::this_thread::sleep_until(sent_until);
+            }
+            ssize_t ret = send(fd, p, chunk, MSG_NOSIGNAL);
+            if (ret <= 0) {
+                return false;
+            }
+            p += ret;
+            len -= ret;
+        }
+        return true;
+    }
+
+    bool send_str(std::string const& s, bool first = true) {
+        return send_all(s.data(), s.size(), first);
+    }
+
+    bool reply(long long ret) {
+        return send_str(std::to_string(ret) + "\n");
+    }
+
+    bool reply_value(std::string const& v) {
+        std::string s = std::to_string(v.size() + 1) + "\n";
+        s += v;
+        s += '\0';
+        s += '\n';
+        return send_str(s);
+    }
+
+    void serve() {
+        std::string line;
+        while (read_line(&line)) {
+            std::vector<std::string> w;
+            size_t p = 0;
+            while (p < line.size()) {
+                size_t e = line.find(' ', p);
+                if (e == std::string::npos) {
+                    e = line.size();
+                }
+                if (e > p) {
+                    w.push_back(line.substr(p, e - p));
+                }
+                p = e + 1;
+            }
+            if (w.empty()) {
+                continue;
+            }
+            if (!dispatch(w)) {
+                return;
+            }
+        }
+    }
+
+private:
+    /* Parses "<dev> [INPUT|OUTPUT <chn>] [DEBUG|BUFFER] [<attr>]" */
+    int parse_target(std::vector<std::string> const& w, size_t n,
+            Sim_Device** dev, Sim_Channel** chn, std::string* attr, bool* buffer_attr) {
+        *chn = nullptr;
+        *buffer_attr = false;
+        attr->clear();
+        if (w.size() < 2 || (*dev = find_device(w[1])) == nullptr) {
+            return -ENODEV;
+        }
+        size_t i = 2;
+        if (i + 1 < n && (w[i] == "INPUT" || w[i] == "OUTPUT")) {
+            *chn = find_channel(*dev, w[i + 1], w[i] == "OUTPUT");
+            if (*chn == nullptr) {
+                return -ENXIO;
+            }
+            i += 2;
+        } else if (i < n && (w[i] == "DEBUG" || w[i] == "BUFFER")) {
+            *buffer_attr = w[i] == "BUFFER";
+            if (w[i] == "DEBUG") {
+                return -ENOENT;
+            }
+            i++;
+        }
+        if (i < n) {
+            *attr = w[i];
+        }
+        return 0;
+    }
+
+    std::vector<std::string>* attr_list(Sim_Device* dev, Sim_Channel* chn, bool buffer_attr) {
+        if (chn) {
+            return &chn->attrs;
+        }
+        return buffer_attr ? &dev->buffer_attrs : &dev->attrs;
+    }
+
+    bool cmd_read(std::vector<std::string> const& w) {
+        Sim_Device* dev;
+        Sim_Channel* chn;
+        std::string attr;
+        bool buffer_attr;
+        int ret = parse_target(w, w.size(), &dev, &chn, &attr, &buffer_attr);
+        if (ret < 0) {
+            return reply(ret);
+        }
+        if (!attr.empty()) {
+            std::string v;
+            if ((ret = read_attr(dev, chn, attr, &v)) < 0) {
+                return reply(ret);
+            }
+            return reply_value(v);
+        }
+
+        /* Read all: one big-endian length word per attribute, then the
+         * value padded to 4 bytes */
+        std::string blob;
+        for (auto& a : *attr_list(dev, chn, buffer_attr)) {
+            std::string v;
+            int32_t len = read_attr(dev, chn, a, &v) < 0 ? -EACCES : (int32_t)v.size() + 1;
+            uint32_t be = htonl((uint32_t)len);
+            blob.append((char*)&be, 4);
+            if (len > 0) {
+                blob += v;
+                blob += '\0';
+                blob.append((4 - len % 4) % 4, '\0');
+            }
+        }
+        return send_str(std::to_string(blob.size()) + "\n" + blob + "\n");
+    }
+
+    bool cmd_write(std::vector<std::string> const& w) {
+        Sim_Device* dev;
+        Sim_Channel* chn;
+        std::string attr;
+        bool buffer_attr;
+        if (w.size() < 3) {
+            return reply(-EINVAL);
+        }
+        size_t len;
+        if (!parse_size(w.back(), &len)) {
+            return reply(-EINVAL);
+        }
+        int ret = parse_target(w, w.size() - 1, &dev, &chn, &attr, &buffer_attr);
+        std::string data;
+        if (!read_bytes(&data, len)) {
+            return false;
+        }
+        if (ret < 0) {
+            return reply(ret);
+        }
+        if (!attr.empty()) {
+            ret = write_attr(dev, chn, attr, data);
+            return reply(ret < 0 ? ret : (long long)len);
+        }
+
+        size_t p = 0;
+        for (auto& a : *attr_list(dev, chn, buffer_attr)) {
+            if (p + 4 > data.size()) {
+                break;
+            }
+            uint32_t be;
+            memcpy(&be, data.data() + p, 4);
+            int32_t alen = (int32_t)ntohl(be);
+            p += 4;
+            if (alen <= 0) {
+                continue;
+            }
+            if ((ret = write_attr(dev, chn, a, data.substr(p, alen))) < 0) {
+                return reply(ret);
+            }
+            p += alen + (4 - alen % 4) % 4;
+        }
+        return reply((long long)len);
+    }
+
+    bool cmd_open(std::vector<std::string> const& w) {
+        Sim_Device* dev;
+        if (w.size() < 4 || (dev = find_device(w[1])) == nullptr) {
+            return reply(-ENODEV);
+        }
+        size_t samples;
+        if (!parse_size(w[2], &samples) || w[3].size() % 8 != 0) {
+            return reply(-EINVAL);
+        }
+        buffer.dev = dev;
+        buffer.samples = samples;
+        buffer.channels.clear();
+        buffer.next = std::chrono::steady_clock::now();
+
+        /* The mask is printed most significant 32-bit word first */
+        std::string const& mask = w[3];
+        for (auto& c : dev->channels) {
+            if (c.scan_index < 0) {
+                continue;
+            }
+            size_t word = c.scan_index / 32;
+            size_t words = mask.size() / 8;
+            if (word >= words) {
+                continue;
+            }
+            long long bits;
+            if (!parse_int(mask.substr((words - 1 - word) * 8, 8), &bits, 16)) {
+                buffer.dev = nullptr;
+                return reply(-EINVAL);
+            }
+            if (bits & (1ll << (c.scan_index % 32))) {
+                buffer.channels.push_back(&c);
+            }
+        }
+        std::sort(buffer.channels.begin(), buffer.channels.end(),
+            [](Sim_Channel* a, Sim_Channel* b) { return a->scan_index < b->scan_index; });
+        if (buffer.channels.empty()) {
+            buffer.dev = nullptr;
+            return reply(-EINVAL);
+        }
+        return reply(0);
+    }
+
+    double sample_rate() {
+        std::lock_guard<std::mutex> l(state_lock);
+        long long fs = 0;
+        parse_int(values["iio:device0/in/voltage0/sampling_frequency"], &fs);
+        return (double)fs;
+    }
+
+    void pace(size_t samples) {
+        if (!opt.pace) {
+            return;
+        }
+        double fs = sample_rate();
+        if (fs <= 0) {
+            return;
+        }
+        buffer.next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(samples / fs));
+        std::this_thread::sleep_until(buffer.next);
+    }
+
+    /* I/Q tone at the simulated carrier, visible when the RX LO is
+     * within half the sample rate of it, plus a little noise. */
+    void synthesize(size_t samples) {
+        size_t chans = buffer.channels.size();
+        rx.resize(samples * chans * 2);
+        double fs = sample_rate();
+        double offset;
+        {
+            std::lock_guard<std::mutex> l(state_lock);
+            offset = opt.tone_hz - lo_frequency(0);
+        }
+        double amp = fs > 0 && std::fabs(offset) < fs / 2 ? 1000 : 0;
+        double inc = fs > 0 ? 2 * M_PI * offset / fs : 0;
+        int16_t* out = (int16_t*)rx.data();
+        for (size_t i = 0; i < samples; i++) {
+            for (size_t c = 0; c < chans; c++) {
+                noise = noise * 1664525u + 1013904223u;
+                double s = c % 2 ? std::sin(phase) : std::cos(phase);
+                *out++ = (int16_t)(amp * s + (int)(noise >> 29) - 4);
+            }
+            phase += inc;
+        }
+        phase = std::fmod(phase, 2 * M_PI);
+    }
+
+    bool cmd_readbuf(std::vector<std::string> const& w) {
+        if (w.size() < 3 || buffer.dev == nullptr || find_device(w[1]) != buffer.dev) {
+            return reply(-EBADF);
+        }
+        size_t len;
+        if (!parse_size(w[2], &len)) {
+            return reply(-EINVAL);
+        }
+        size_t sample_size = buffer.channels.size() * 2;
+        size_t samples = len / sample_size;
+        pace(samples);
+        synthesize(samples);
+
+        std::string head = std::to_string(rx.size()) + "\n";
+        size_t words = (buffer.dev->channels.size() + 31) / 32;
+        std::vector<uint32_t> mask(words, 0);
+        for (auto c : buffer.channels) {
+            mask[c->scan_index / 32] |= 1u << (c->scan_index % 32);
+        }
+        char word[9];
+        for (size_t i = words; i > 0; i--) {
+            snprintf(word, sizeof(word), "%08x", mask[i - 1]);
+            head += word;
+        }
+        head += "\n";
+        return send_str(head) && send_all(rx.data(), rx.size(), false);
+    }
+
+    bool cmd_writebuf(std::vector<std::string> const& w) {
+        if (w.size() < 3 || buffer.dev == nullptr || find_device(w[1]) != buffer.dev) {
+            return reply(-EBADF);
+        }
+        size_t len;
+        if (!parse_size(w[2], &len)) {
+            return reply(-EINVAL);
+        }
+        if (!reply((long long)len)) {
+            return false;
+        }
+        std::string data;
+        if (!read_bytes(&data, len)) {
+            return false;
+        }
+        pace(len / (buffer.channels.size() * 2));
+        return reply((long long)len);
+    }
+
+    bool dispatch(std::vector<std::string> const& w) {
+        std::string const& cmd = w[0];
+        if (cmd == "VERSION") {
+            return send_str("0.25.iiodsim\n");
+        } else if (cmd == "PRINT") {
+            std::string xml = context_xml();
+            return send_str(std::to_string(xml.size()) + "\n" + xml + "\n");
+        } else if (cmd == "READ") {
+            return cmd_read(w);
+        } else if (cmd == "WRITE") {
+            return cmd_write(w);
+        } else if (cmd == "OPEN") {
+            return cmd_open(w);
+        } else if (cmd == "CLOSE") {
+            buffer.dev = nullptr;
+            return reply(0);
+        } else if (cmd == "READBUF") {
+            return cmd_readbuf(w);
+        } else if (cmd == "WRITEBUF") {
+            return cmd_writebuf(w);
+        } else if (cmd == "TIMEOUT" || cmd == "SET" || cmd == "SETTRIG") {
+            return reply(0);
+        } else if (cmd == "GETTRIG") {
+            return reply(-ENOENT);
+        } else if (cmd == "EXIT") {
+            return false;
+        }
+        return reply(-EINVAL);
+    }
+};
+
+/* Simulated link loss: every client sees its connection reset, and new
+ * ones are refused for the outage. */
+void drop_loop() {
+    for (;;) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(opt.drop_s));
+        std::lock_guard<std::mutex> l(clients_lock);
+        refuse_until = std::chrono::steady_clock::now() + std::chrono::milliseconds(opt.outage_ms);
+        for (int fd : clients) {
+            shutdown(fd, SHUT_RDWR);
+        }
+        printf("* dropped %zu connections for %ld ms\n", clients.size(), opt.outage_ms);
+        fflush(stdout);
+    }
+}
+
+void usage(const char* argv0) {
+    fprintf(stderr,
+        "Usage: %s [-p port] [-l latency_us] [-b bytes_per_s] [-r retune_us]\n"
+        "          [-f recall_us] [-t tone_hz] [-P] [-d drop_s] [-o outage_ms]\n"
+        "  -p  TCP port (default 30431)\n"
+        "  -l  latency added before every reply\n"
+        "  -b  bandwidth limit for replies, 0 for unlimited\n"
+        "  -r  cost of an LO frequency write (synthesizer calibration)\n"
+        "  -f  cost of a fastlock profile recall\n"
+        "  -t  RF frequency of the simulated carrier\n"
+        "  -P  pace buffers at the configured sampling_frequency\n"
+        "  -d  drop every client connection this often, in seconds\n"
+        "  -o  refuse connections for this long after a drop (default 500)\n", argv0);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    int c;
+    while ((c = getopt(argc, argv, "p:l:b:r:f:t:Pd:o:h")) != -1) {
+        switch (c) {
+        case 'p': opt.port = atoi(optarg); break;
+        case 'l': opt.latency_us = atol(optarg); break;
+        case 'b': opt.bandwidth = atof(optarg); break;
+        case 'r': opt.retune_us = atol(optarg); break;
+        case 'f': opt.recall_us = atol(optarg); break;
+        case 't': opt.tone_hz = atof(optarg); break;
+        case 'P': opt.pace = true; break;
+        case 'd': opt.drop_s = atof(optarg); break;
+        case 'o': opt.outage_ms = atol(optarg); break;
+        default: usage(argv[0]); return c == 'h' ? 0 : 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    build_devices();
+
+    int srv = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt.port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(srv, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(srv, 16) < 0) {
+        perror("iiod-sim");
+        return 1;
+    }
+    printf("* iiod-sim listening on 127.0.0.1:%d\n", opt.port);
+    fflush(stdout);
+
+    if (opt.drop_s > 0) {
+        std::thread(drop_loop).detach();
+    }
+
+    for (;;) {
+        int fd = accept(srv, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> l(clients_lock);
+            if (std::chrono::steady_clock::now() < refuse_until) {
+                close(fd);
+                continue;
+            }
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        std::thread([fd] {
+            Connection conn(fd);
+            conn.serve();
+        }).detach();
+    }
+}
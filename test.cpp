@@ -30,6 +30,7 @@
 #include <iio/iio.h>
 #else
 #include "iioc++.h"
+#include "iioc++_stream.h"
 #endif
 
 using namespace Hz;
@@ -39,11 +40,16 @@ enum iodev { RX, TX };
 
 /* IIO structs required for streaming */
 static bool stop;
+static Cancellation_Token* cancel_token;
 
 static void handle_sig(int sig)
 {
 	printf("Waiting for process to finish...\n");
 	stop = true;
+	// Unblocks a refill or push in flight
+	if (cancel_token) {
+		cancel_token->cancel();
+	}
 }
 
 int main (int argc, char **argv)
@@ -58,6 +64,7 @@ int main (int argc, char **argv)
 
 	printf("* Acquiring IIO context\n");
 	Context ctx("network", "192.168.2.1");
+	printf("* Context created in %.1f ms\n", ctx.creation_latency() * 1e3);
 	if(ctx.devices.size() == 0) {std::cout << "No devices" << std::endl;}
 
 	printf("* Acquiring AD9361 streaming devices\n");
@@ -66,19 +73,24 @@ int main (int argc, char **argv)
 	Device rx = ctx.devices["cf-ad9361-lpc"];
 
 	printf("* Configuring AD9361 for streaming\n");
-	ctx.devices["ad9361-phy"].in["voltage0"].attributes["rf_port_select"] = "A_BALANCED";
+	Device phy = ctx.devices["ad9361-phy"];
+	Config_Transaction config;
+	config.set(phy.in["voltage0"], ad9361::rf_port_select, "A_BALANCED");
 	//wr_ch_lli(chn, "hardwaregain",     71);
-	ctx.devices["ad9361-phy"].out["altvoltage0"].attributes["frequency"] = 2.4_GHz;
-    ctx.devices["ad9361-phy"].in["voltage0"].attributes["rf_bandwidth"] = 2_MHz;
-	ctx.devices["ad9361-phy"].in["voltage0"].attributes["sampling_frequency"] = 2.5_MHz;
-
+	config.set(phy.out["altvoltage0"], ad9361::frequency, 2.4_GHz);
+	config.set(phy.in["voltage0"], ad9361::rf_bandwidth, 2_MHz);
+	config.set(phy.in["voltage0"], ad9361::sampling_frequency, 2.5_MHz);
 
-	ctx.devices["ad9361-phy"].out["voltage0"].attributes["rf_port_select"] = "A";
+	config.set(phy.out["voltage0"], ad9361::rf_port_select, "A");
 	//wr_ch_lli(chn, "hardwaregain",     10);
-	//ctx.devices["ad9361-phy"].out["voltage011111"];
-	ctx.devices["ad9361-phy"].out["altvoltage1"].attributes["frequency"] = 2.4_GHz;
-    ctx.devices["ad9361-phy"].out["voltage0"].attributes["rf_bandwidth"] = 1.5_MHz;
-	ctx.devices["ad9361-phy"].out["voltage0"].attributes["sampling_frequency"] = 2.5_MHz;
+	config.set(phy.out["altvoltage1"], ad9361::frequency, 2.4_GHz);
+	config.set(phy.out["voltage0"], ad9361::rf_bandwidth, 1.5_MHz);
+	config.set(phy.out["voltage0"], ad9361::sampling_frequency, 2.5_MHz);
+	for (auto& r : config.commit()) {
+		if (!r.ok()) {
+			printf("Error writing %s %s: %d\n", r.target.c_str(), r.key, r.err);
+		}
+	}
 
 	printf("* Initializing AD9361 IIO streaming channels\n");
 	printf("* Enabling IIO streaming channels\n");
@@ -91,6 +103,12 @@ int main (int argc, char **argv)
 	printf("* Creating non-cyclic IIO buffers with 1 MiS\n");
 	Buffer rxbuf(rx, 1024*1024, false);
 	Buffer txbuf(tx, 1024*1024, false);
+	Cancellation_Token token;
+	Cancellation_Token::Attach rx_cancel(token, rxbuf);
+	Cancellation_Token::Attach tx_cancel(token, txbuf);
+	cancel_token = &token;
+	// Absolute TX sample index, gaps are late pushes the DAC ran dry on
+	Sample_Timeline tx_timeline(2.5e6, 4 * 1024 * 1024);
 
 	printf("* Starting IO streaming (press CTRL+C to cancel)\n");
 	int a = 0;
@@ -102,7 +120,12 @@ int main (int argc, char **argv)
 		ptrdiff_t t_inc;
 		// Schedule TX buffer
 		ssize_t nbytes_tx = txbuf.push();
+		if (nbytes_tx < 0 && token.cancelled()) { break; }
 		if (nbytes_tx < 0) { printf("Error pushing buf %d\n", (int) nbytes_tx); exit(0); }
+		tx_timeline.advance(nbytes_tx / tx.sample_size());
+		for (auto& g : tx_timeline.take_gaps()) {
+			printf("\tTX gap at sample %llu, %llu samples lost\n", (unsigned long long)g.index, (unsigned long long)g.lost);
+		}
 
 		// Refill RX buffer
 		//nbytes_rx = rxbuf.refill();
@@ -131,6 +154,7 @@ int main (int argc, char **argv)
 		std::cout << "\tRX " << (1. * nbytes_tx/1e6) / seconds1 << std::endl;
 		std::cout << "\tRX " << (1. * nrx/1e6) / seconds <<" MSmp, TX " << (1. * ntx/1e6) / seconds << " MSmp\n";
 	}
+	cancel_token = nullptr;
 	return 0;
 }
 